@@ -0,0 +1,593 @@
+/*
+ * fminc_bench.cpp
+ *
+ * Benchmarks for NFmiNetCDF read and write paths. Synthetic input files are
+ * generated to a temporary directory in several layouts (latitude-longitude,
+ * polar stereographic, with and without levels and ensemble members, classic
+ * and netcdf4 format).
+ *
+ * Usage: fminc_bench [filter]
+ *
+ * Only benchmarks whose name contains 'filter' are run. Output format follows
+ * google benchmark: time per iteration, iterations, and throughput as MB/s
+ * and slices/s where applicable.
+ */
+
+#include "NFmiNetCDF.h"
+#include "NFmiNetCDFPool.h"
+#include "NFmiPrefetcher.h"
+#include "NFmiSliceCache.h"
+#include <boost/filesystem.hpp>
+#include <chrono>
+#include <fmt/format.h>
+#include <functional>
+#include <numeric>
+
+using namespace std;
+
+namespace
+{
+const double kMinTime = 0.5;  // seconds per benchmark
+const long kMaxIterations = 1000000;
+
+struct State
+{
+	size_t bytes = 0;
+	size_t slices = 0;
+};
+
+string theFilter;
+
+// Keep compiler from optimizing away unused results
+template <typename T>
+void DoNotOptimize(const T& val)
+{
+	asm volatile("" : : "r,m"(val) : "memory");
+}
+
+void RunBenchmark(const string& name, const function<void(State&)>& fn)
+{
+	if (!theFilter.empty() && name.find(theFilter) == string::npos)
+	{
+		return;
+	}
+
+	// warm up: first call also populates lazily read caches
+
+	State warmup;
+	fn(warmup);
+
+	State state;
+	long iterations = 0;
+	double elapsed = 0;
+
+	const auto start = chrono::steady_clock::now();
+
+	do
+	{
+		fn(state);
+		iterations++;
+		elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	} while (elapsed < kMinTime && iterations < kMaxIterations);
+
+	const double ns = 1e9 * elapsed / static_cast<double>(iterations);
+
+	string throughput;
+
+	if (state.bytes > 0)
+	{
+		throughput += fmt::format(" {:>10.1f} MB/s", static_cast<double>(state.bytes) / elapsed / 1024 / 1024);
+	}
+
+	if (state.slices > 0)
+	{
+		throughput += fmt::format(" {:>12.1f} slices/s", static_cast<double>(state.slices) / elapsed);
+	}
+
+	fmt::print("{:<52} {:>14.0f} ns {:>10}{}\n", name, ns, iterations, throughput);
+}
+
+/*
+ * Synthetic data files
+ */
+
+struct Config
+{
+	string name;
+	bool stereographic;
+	bool levels;
+	bool members;
+	NcFile::FileFormat format;
+};
+
+const long NX = 300;
+const long NY = 200;
+const long NT = 24;
+const long NZ = 10;
+const long NM = 5;
+
+bool Generate(const string& fileName, const Config& conf)
+{
+	NcFile file(fileName.c_str(), NcFile::Replace, nullptr, 0, conf.format);
+
+	if (!file.is_valid())
+	{
+		return false;
+	}
+
+	file.add_att("Conventions", "CF-1.6");
+
+	NcDim* xdim = file.add_dim(conf.stereographic ? "x" : "lon", NX);
+	NcDim* ydim = file.add_dim(conf.stereographic ? "y" : "lat", NY);
+	NcDim* tdim = file.add_dim("time");
+	NcDim* zdim = conf.levels ? file.add_dim("level", NZ) : nullptr;
+	NcDim* mdim = conf.members ? file.add_dim("ensemble_member", NM) : nullptr;
+
+	NcVar* xvar = file.add_var(xdim->name(), ncFloat, xdim);
+	NcVar* yvar = file.add_var(ydim->name(), ncFloat, ydim);
+	NcVar* tvar = file.add_var("time", ncDouble, tdim);
+
+	tvar->add_att("units", "hours since 2024-01-01 00:00:00");
+	tvar->add_att("axis", "T");
+
+	vector<float> x(NX), y(NY);
+
+	NcVar* lonvar = nullptr;
+	NcVar* latvar = nullptr;
+
+	if (conf.stereographic)
+	{
+		xvar->add_att("standard_name", "projection_x_coordinate");
+		xvar->add_att("units", "m");
+		xvar->add_att("axis", "X");
+		yvar->add_att("standard_name", "projection_y_coordinate");
+		yvar->add_att("units", "m");
+		yvar->add_att("axis", "Y");
+
+		NcVar* proj = file.add_var("stereographic", ncInt);
+		proj->add_att("grid_mapping_name", "polar_stereographic");
+		proj->add_att("longitude_of_projection_origin", 20.);
+		proj->add_att("latitude_of_projection_origin", 60.);
+		proj->add_att("straight_vertical_longitude_from_pole", 20.);
+
+		lonvar = file.add_var("longitude", ncFloat, ydim, xdim);
+		lonvar->add_att("standard_name", "longitude");
+		lonvar->add_att("units", "degrees_east");
+		latvar = file.add_var("latitude", ncFloat, ydim, xdim);
+		latvar->add_att("standard_name", "latitude");
+		latvar->add_att("units", "degrees_north");
+
+		for (long i = 0; i < NX; i++)
+			x[static_cast<size_t>(i)] = static_cast<float>(i * 2500);
+		for (long j = 0; j < NY; j++)
+			y[static_cast<size_t>(j)] = static_cast<float>(j * 2500);
+	}
+	else
+	{
+		xvar->add_att("standard_name", "longitude");
+		xvar->add_att("units", "degrees_east");
+		yvar->add_att("standard_name", "latitude");
+		yvar->add_att("units", "degrees_north");
+
+		for (long i = 0; i < NX; i++)
+			x[static_cast<size_t>(i)] = -10.f + 0.1f * static_cast<float>(i);
+		for (long j = 0; j < NY; j++)
+			y[static_cast<size_t>(j)] = 50.f + 0.1f * static_cast<float>(j);
+	}
+
+	NcVar* zvar = nullptr;
+
+	if (zdim)
+	{
+		zvar = file.add_var("level", ncFloat, zdim);
+		zvar->add_att("units", "hPa");
+		zvar->add_att("axis", "Z");
+		zvar->add_att("positive", "down");
+	}
+
+	NcVar* mvar = mdim ? file.add_var("ensemble_member", ncInt, mdim) : nullptr;
+
+	// parameters; dimension order is (t, [m], [z], y, x)
+
+	vector<const NcDim*> dims{tdim};
+
+	if (mdim)
+		dims.push_back(mdim);
+	if (zdim)
+		dims.push_back(zdim);
+
+	dims.push_back(ydim);
+	dims.push_back(xdim);
+
+	const vector<string> params{"air_temperature", "relative_humidity", "wind_speed"};
+	vector<NcVar*> pvars;
+
+	for (const auto& name : params)
+	{
+		NcVar* var = file.add_var(name.c_str(), ncFloat, static_cast<int>(dims.size()), dims.data());
+		var->add_att("units", "1");
+		var->add_att("_FillValue", -999.f);
+
+		if (conf.stereographic)
+			var->add_att("grid_mapping", "stereographic");
+
+		pvars.push_back(var);
+	}
+
+	// data
+
+	xvar->put(x.data(), NX);
+	yvar->put(y.data(), NY);
+
+	vector<double> t(NT);
+	iota(t.begin(), t.end(), 0.);
+	tvar->put(t.data(), NT);
+
+	if (zvar)
+	{
+		const vector<float> z{1000, 925, 850, 700, 500, 400, 300, 250, 200, 100};
+		zvar->put(z.data(), NZ);
+	}
+
+	if (mvar)
+	{
+		vector<int> m(NM);
+		iota(m.begin(), m.end(), 0);
+		mvar->put(m.data(), NM);
+	}
+
+	if (lonvar && latvar)
+	{
+		vector<float> lon(NX * NY), lat(NX * NY);
+
+		for (long j = 0; j < NY; j++)
+		{
+			for (long i = 0; i < NX; i++)
+			{
+				const auto k = static_cast<size_t>(j * NX + i);
+				lon[k] = 10.f + 0.03f * static_cast<float>(i);
+				lat[k] = 55.f + 0.02f * static_cast<float>(j);
+			}
+		}
+
+		lonvar->put(lon.data(), NY, NX);
+		latvar->put(lat.data(), NY, NX);
+	}
+
+	vector<long> counts;
+
+	for (const NcDim* d : dims)
+	{
+		counts.push_back(d == tdim ? NT : d->size());
+	}
+
+	const size_t N = accumulate(counts.begin(), counts.end(), size_t(1), multiplies<size_t>());
+	vector<float> data(N);
+
+	for (size_t i = 0; i < N; i++)
+	{
+		data[i] = static_cast<float>(i % 1000) * 0.1f;
+	}
+
+	for (NcVar* var : pvars)
+	{
+		var->put(data.data(), counts.data());
+	}
+
+	return file.close();
+}
+
+void ReadBenchmarks(const string& fileName, const string& prefix)
+{
+	RunBenchmark(prefix + "/Read", [&](State&) { NFmiNetCDF nc(fileName); });
+
+	RunBenchmark(prefix + "/NFmiNetCDFPool::Get",
+	             [&](State&) { DoNotOptimize(NFmiNetCDFPool::Instance().Get(fileName)->SizeX()); });
+
+	NFmiNetCDF nc(fileName);
+
+	const size_t sliceSize = static_cast<size_t>(nc.SizeX() * nc.SizeY());
+
+	RunBenchmark(prefix + "/Values<float>",
+	             [&](State& st)
+	             {
+		             nc.FirstParam();
+		             nc.ResetTime();
+
+		             while (nc.NextTime())
+		             {
+			             nc.ResetLevel();
+			             nc.NextLevel();
+
+			             do
+			             {
+				             const auto v = nc.Values<float>();
+				             st.bytes += v.size() * sizeof(float);
+				             st.slices++;
+			             } while (nc.NextLevel());
+		             }
+	             });
+
+	RunBenchmark(prefix + "/Values<double>",
+	             [&](State& st)
+	             {
+		             nc.FirstParam();
+		             nc.ResetTime();
+		             nc.ResetLevel();
+		             nc.NextLevel();
+
+		             while (nc.NextTime())
+		             {
+			             const auto v = nc.Values<double>();
+			             st.bytes += v.size() * sizeof(double);
+			             st.slices++;
+		             }
+	             });
+
+	vector<float> buffer;
+
+	RunBenchmark(prefix + "/Values<float>(buffer)",
+	             [&](State& st)
+	             {
+		             nc.FirstParam();
+		             nc.ResetTime();
+		             nc.ResetLevel();
+		             nc.NextLevel();
+
+		             while (nc.NextTime())
+		             {
+			             buffer.resize(nc.SliceSize());
+			             nc.Values<float>(buffer.data(), buffer.size());
+			             st.bytes += buffer.size() * sizeof(float);
+			             st.slices++;
+		             }
+	             });
+
+	nc.Unpack(true);
+
+	RunBenchmark(prefix + "/Values<float>(buffer, unpack)",
+	             [&](State& st)
+	             {
+		             nc.FirstParam();
+		             nc.ResetTime();
+		             nc.ResetLevel();
+		             nc.NextLevel();
+
+		             while (nc.NextTime())
+		             {
+			             buffer.resize(nc.SliceSize());
+			             nc.Values<float>(buffer.data(), buffer.size());
+			             st.bytes += buffer.size() * sizeof(float);
+			             st.slices++;
+		             }
+	             });
+
+	nc.Unpack(false);
+
+	RunBenchmark(prefix + "/NFmiPrefetcher<float>(all slices)",
+	             [&](State& st)
+	             {
+		             NFmiPrefetcher<float> it(nc, NFmiPrefetcher<float>::AllSlices(nc, {"air_temperature"}), 4);
+
+		             while (it.Next())
+		             {
+			             st.bytes += it.Values().size() * sizeof(float);
+			             st.slices++;
+		             }
+	             });
+
+	NFmiSliceCache cache(1024 * 1024 * 1024);
+	nc.SliceCache(&cache);
+
+	RunBenchmark(prefix + "/SharedValues<float>(slice cache)",
+	             [&](State& st)
+	             {
+		             nc.ResetTime();
+
+		             while (nc.NextTime())
+		             {
+			             const auto v = nc.SharedValues<float>("air_temperature");
+			             st.bytes += v->size() * sizeof(float);
+			             st.slices++;
+		             }
+	             });
+
+	nc.SliceCache(nullptr);
+
+	const NFmiNetCDF::IndexWindow window{nc.SizeX() / 4, nc.SizeY() / 4, nc.SizeX() / 8, nc.SizeY() / 8};
+
+	RunBenchmark(prefix + "/Values<float>(window)",
+	             [&](State& st)
+	             {
+		             nc.ResetTime();
+
+		             while (nc.NextTime())
+		             {
+			             const auto v = nc.Values<float>("air_temperature", window);
+			             st.bytes += v.size() * sizeof(float);
+			             st.slices++;
+		             }
+	             });
+
+	vector<NFmiNetCDF::GridPoint> points;
+
+	for (long i = 0; i < 1000; i++)
+	{
+		points.push_back({static_cast<double>((i * 7919) % nc.SizeX()) + 0.5,
+		                  static_cast<double>((i * 104729) % nc.SizeY()) * 0.999});
+	}
+
+	// point values are not supported with ensemble member dimension
+
+	if (!nc.HasDimension("ensemble_member"))
+	{
+		RunBenchmark(prefix + "/PointValues<float>(1000 points, interpolated)",
+		             [&](State& st)
+		             {
+			             const long level = (nc.SizeZ() > 0) ? 0 : -1;
+			             const auto v = nc.PointValues<float>("air_temperature", points, 0, nc.SizeT(), level, true);
+			             st.bytes += v.size() * sizeof(float);
+		             });
+	}
+
+	RunBenchmark(prefix + "/Values<float>(all times)",
+	             [&](State& st)
+	             {
+		             const long nz = std::max(1L, nc.SizeZ());
+		             const auto v = nc.Values<float>("air_temperature", 0, nc.SizeT(), 0, nz);
+		             st.bytes += v.size() * sizeof(float);
+		             st.slices += static_cast<size_t>(nc.SizeT() * nz);
+	             });
+
+	RunBenchmark(prefix + "/Time",
+	             [&](State& st)
+	             {
+		             nc.ResetTime();
+
+		             while (nc.NextTime())
+		             {
+			             DoNotOptimize(nc.Time<double>());
+			             st.slices++;
+		             }
+	             });
+
+	RunBenchmark(prefix + "/Level",
+	             [&](State& st)
+	             {
+		             nc.ResetLevel();
+
+		             while (nc.NextLevel())
+		             {
+			             DoNotOptimize(nc.Level());
+			             st.slices++;
+		             }
+	             });
+
+	RunBenchmark(prefix + "/XResolution(cold)",
+	             [&](State&)
+	             {
+		             NFmiNetCDF n(fileName);
+		             DoNotOptimize(n.XResolution());
+		             DoNotOptimize(n.YResolution());
+	             });
+
+	RunBenchmark(prefix + "/XResolution",
+	             [&](State&)
+	             {
+		             DoNotOptimize(nc.XResolution());
+		             DoNotOptimize(nc.YResolution());
+	             });
+
+	RunBenchmark(prefix + "/Coordinates",
+	             [&](State&)
+	             {
+		             DoNotOptimize(nc.X0<double>());
+		             DoNotOptimize(nc.Y0<double>());
+		             DoNotOptimize(nc.X1<double>());
+		             DoNotOptimize(nc.Y1<double>());
+		             DoNotOptimize(nc.Lat0<double>());
+		             DoNotOptimize(nc.Lon0<double>());
+		             DoNotOptimize(nc.Orientation());
+		             DoNotOptimize(nc.TrueLatitude());
+	             });
+
+	const string outFile = boost::filesystem::path(fileName).replace_extension(".out.nc").string();
+
+	RunBenchmark(prefix + "/WriteSlice",
+	             [&](State& st)
+	             {
+		             nc.FirstParam();
+		             nc.ResetTime();
+		             nc.NextTime();
+		             nc.ResetLevel();
+		             nc.NextLevel();
+
+		             nc.WriteSlice(outFile);
+		             st.bytes += sliceSize * sizeof(float);
+		             st.slices++;
+	             });
+
+	RunBenchmark(prefix + "/WriteSlices(all)",
+	             [&](State& st)
+	             {
+		             nc.WriteSlices(outFile, {});
+		             const size_t slices = static_cast<size_t>(nc.SizeParams() * nc.SizeT() * std::max(1L, nc.SizeZ()));
+		             st.bytes += slices * sliceSize * sizeof(float);
+		             st.slices += slices;
+	             });
+
+	NFmiNetCDF::WriteOptions compressed;
+	compressed.netcdf4 = true;
+	compressed.deflateLevel = 4;
+	compressed.shuffle = true;
+
+	RunBenchmark(prefix + "/WriteSlices(all, nc4 deflate=4 shuffle)",
+	             [&](State& st)
+	             {
+		             nc.WriteSlices(outFile, {}, {}, {}, compressed);
+		             const size_t slices = static_cast<size_t>(nc.SizeParams() * nc.SizeT() * std::max(1L, nc.SizeZ()));
+		             st.bytes += slices * sliceSize * sizeof(float);
+		             st.slices += slices;
+	             });
+
+	NFmiNetCDF::WriteOptions packed;
+	packed.packShorts = true;
+
+	RunBenchmark(prefix + "/WriteSlices(all, packShorts)",
+	             [&](State& st)
+	             {
+		             nc.WriteSlices(outFile, {}, {}, {}, packed);
+		             const size_t slices = static_cast<size_t>(nc.SizeParams() * nc.SizeT() * std::max(1L, nc.SizeZ()));
+		             st.bytes += slices * sliceSize * sizeof(float);
+		             st.slices += slices;
+	             });
+
+	boost::filesystem::remove(outFile);
+}
+
+}  // namespace
+
+int main(int argc, char** argv)
+{
+	if (argc > 1)
+	{
+		theFilter = argv[1];
+	}
+
+	const auto dir = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("fminc-bench-%%%%%%");
+	boost::filesystem::create_directories(dir);
+
+	const vector<Config> configs{
+	    {"latlon", false, false, false, NcFile::Classic},
+	    {"latlon_levels", false, true, false, NcFile::Classic},
+	    {"latlon_members", false, false, true, NcFile::Classic},
+	    {"stereographic", true, false, false, NcFile::Classic},
+	    {"stereographic_levels", true, true, false, NcFile::Classic},
+	    {"latlon_nc4", false, false, false, NcFile::Netcdf4},
+	    {"latlon_levels_nc4", false, true, false, NcFile::Netcdf4},
+	    {"stereographic_nc4", true, false, false, NcFile::Netcdf4},
+	};
+
+	fmt::print("{:<52} {:>17} {:>10} {}\n", "Benchmark", "Time", "Iterations", "Throughput");
+	fmt::print("{}\n", string(110, '-'));
+
+	int ret = 0;
+
+	for (const auto& conf : configs)
+	{
+		const string fileName = (dir / (conf.name + ".nc")).string();
+
+		if (!Generate(fileName, conf))
+		{
+			fmt::print("Unable to create file {}\n", fileName);
+			ret = 1;
+			continue;
+		}
+
+		ReadBenchmarks(fileName, conf.name);
+	}
+
+	boost::filesystem::remove_all(dir);
+
+	return ret;
+}
@@ -0,0 +1,364 @@
+/*
+ * fminc_decode.cpp
+ *
+ * Equivalence check of the vectorized decode kernels in NFmiDecode against
+ * the scalar code. Every kernel set the CPU can run is compared bit for bit
+ * (NaN equals any NaN) to the "scalar" set, and the decode of native byte
+ * order data used by the library read path (DecodeNative) is compared to the
+ * big-endian decode, for float and double output. 'make decode-check' runs
+ * the check.
+ *
+ * The cases are generated with a fixed seed:
+ *
+ * - stored types byte, short, int, float and double
+ * - lengths 0..70, which cover every tail of the 4, 8 and 16 element loops,
+ *   and random lengths up to 4096
+ * - source buffers at offsets 0..7 from an aligned address
+ * - no scaling, typical scale_factor and add_offset, and negative scale
+ * - zero, one or two fill values, which may be NaN, fractional or out of the
+ *   range of the stored type; missing value 32700 or NaN
+ * - random bit patterns mixed with fill values, type limits, zeros, -0,
+ *   infinities, NaNs and subnormals
+ *
+ * Usage: fminc_decode [count]
+ *
+ * 'count' is the number of generated cases (default 200000). Exit status is
+ * nonzero if any result differs.
+ */
+
+#include "NFmiDecode.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fmt/format.h>
+#include <limits>
+#include <netcdf.h>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+using namespace std;
+
+namespace
+{
+const size_t kMaxReported = 20;
+const size_t kMaxLength = 4096;
+const size_t kMaxOffset = 8;
+
+size_t comparisons = 0;
+size_t mismatches = 0;
+
+// xorshift64*, fixed seed so that every run checks the same cases
+
+uint64_t state = 0x9e3779b97f4a7c15ULL;
+
+uint64_t Random()
+{
+	state ^= state >> 12;
+	state ^= state << 25;
+	state ^= state >> 27;
+	return state * 0x2545f4914f6cdd1dULL;
+}
+
+double Uniform()
+{
+	return static_cast<double>(Random() >> 11) / 9007199254740992.0;
+}
+
+const char* TypeName(int type)
+{
+	switch (type)
+	{
+		case NC_BYTE:
+			return "byte";
+		case NC_SHORT:
+			return "short";
+		case NC_INT:
+			return "int";
+		case NC_FLOAT:
+			return "float";
+		default:
+			return "double";
+	}
+}
+
+size_t TypeSize(int type)
+{
+	switch (type)
+	{
+		case NC_BYTE:
+			return 1;
+		case NC_SHORT:
+			return 2;
+		case NC_INT:
+		case NC_FLOAT:
+			return 4;
+		default:
+			return 8;
+	}
+}
+
+template <typename T>
+bool Same(T a, T b)
+{
+	return (std::isnan(a) && std::isnan(b)) || memcmp(&a, &b, sizeof(T)) == 0;
+}
+
+string Describe(int type, size_t n, size_t offset, const DecodeParams& p)
+{
+	return fmt::format("{} n={} offset={} scale={} offset={} fills={} [{}, {}] missing={}", TypeName(type), n, offset,
+	                   p.scale, p.offset, p.fillCount, p.fill[0], p.fill[1], p.missing);
+}
+
+// Return values differ when a double is out of float range, which is reported
+// by all of the decoders
+
+void CompareStatus(const char* what, const string& which, const string& description, bool result, bool expected)
+{
+	comparisons++;
+
+	if (result != expected && mismatches++ < kMaxReported)
+	{
+		fmt::print("{} {} ({}): returned {} != {}\n", what, which, description, result, expected);
+	}
+}
+
+template <typename T>
+void Compare(const char* what, const string& which, const string& description, size_t i, const vector<T>& result,
+             const vector<T>& expected)
+{
+	comparisons++;
+
+	if (Same(result[i], expected[i]))
+	{
+		return;
+	}
+
+	if (mismatches++ < kMaxReported)
+	{
+		fmt::print("{} {} ({}) [{}]: {:.9g} != {:.9g}\n", what, which, description, i, result[i], expected[i]);
+	}
+}
+
+// Value i of a case as stored type U: a fill value, a special value or a
+// random bit pattern
+
+template <typename U>
+U Value(const DecodeParams& p)
+{
+	const uint64_t kind = Random() % 8;
+
+	if (kind < 2 && static_cast<int>(kind) < p.fillCount)
+	{
+		const double fill = p.fill[kind];
+
+		if (is_floating_point<U>::value ||
+		    (fill >= static_cast<double>(numeric_limits<U>::min()) &&
+		     fill <= static_cast<double>(numeric_limits<U>::max()) && fill == std::trunc(fill)))
+		{
+			return static_cast<U>(fill);
+		}
+	}
+
+	if (kind < 4)
+	{
+		vector<U> special = {U(0), U(1), static_cast<U>(-1), numeric_limits<U>::min(), numeric_limits<U>::max(),
+		                     numeric_limits<U>::lowest()};
+
+		if constexpr (is_floating_point<U>::value)
+		{
+			special.insert(special.end(),
+			               {static_cast<U>(-0.0), numeric_limits<U>::infinity(), -numeric_limits<U>::infinity(),
+			                numeric_limits<U>::quiet_NaN(), -numeric_limits<U>::quiet_NaN(),
+			                numeric_limits<U>::denorm_min(), -numeric_limits<U>::denorm_min(), static_cast<U>(32700)});
+		}
+
+		return special[Random() % special.size()];
+	}
+
+	const uint64_t bits = Random();
+	U value;
+	memcpy(&value, &bits, sizeof(U));
+	return value;
+}
+
+template <typename U>
+void StoreBigEndian(unsigned char* dst, U value)
+{
+	unsigned char bytes[sizeof(U)];
+	memcpy(bytes, &value, sizeof(U));
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	reverse(bytes, bytes + sizeof(U));
+#endif
+
+	memcpy(dst, bytes, sizeof(U));
+}
+
+template <typename U>
+void Fill(unsigned char* dst, size_t n, const DecodeParams& p)
+{
+	for (size_t i = 0; i < n; i++)
+	{
+		StoreBigEndian(dst + i * sizeof(U), Value<U>(p));
+	}
+}
+
+// Fill value candidate for stored type: a representable value, NaN for
+// floating point types, or one that no stored value can match
+
+double FillValue(int type)
+{
+	switch (Random() % 6)
+	{
+		case 0:
+			return (type == NC_FLOAT || type == NC_DOUBLE) ? numeric_limits<double>::quiet_NaN() : -1;
+		case 1:
+			return 0.5;
+		case 2:
+			return 1e20;
+		case 3:
+			return (type == NC_BYTE) ? -127 : 32767;
+		default:
+			return static_cast<double>(static_cast<int>(Random() % 200) - 100);
+	}
+}
+
+DecodeParams Params(int type)
+{
+	DecodeParams p;
+
+	switch (Random() % 3)
+	{
+		case 0:
+			break;
+		case 1:
+			p.scale = 0.01;
+			p.offset = 273.15;
+			break;
+		default:
+			p.scale = -0.5 * Uniform();
+			p.offset = 1000 * Uniform() - 500;
+			break;
+	}
+
+	p.fillCount = static_cast<int>(Random() % 3);
+
+	for (int i = 0; i < p.fillCount; i++)
+	{
+		p.fill[i] = FillValue(type);
+	}
+
+	p.missing = (Random() % 4 == 0) ? numeric_limits<double>::quiet_NaN() : 32700;
+
+	return p;
+}
+
+// Same case in native byte order, for DecodeNative
+
+vector<unsigned char> Native(const unsigned char* src, int type, size_t n)
+{
+	const size_t size = TypeSize(type);
+	vector<unsigned char> native(src, src + n * size);
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	for (size_t i = 0; i < n; i++)
+	{
+		reverse(native.begin() + i * size, native.begin() + (i + 1) * size);
+	}
+#endif
+
+	return native;
+}
+
+template <typename T>
+void CheckNative(const unsigned char* src, int type, size_t n, const DecodeParams& p, const string& description)
+{
+	const char* which = is_same<T, float>::value ? "float" : "double";
+	const vector<unsigned char> native = Native(src, type, n);
+	vector<T> result(n), expected(n);
+
+	CompareStatus("DecodeNative", which, description, DecodeNative<T>(native.data(), type, n, result.data(), p),
+	              Decode<T>(src, type, n, expected.data(), p));
+
+	for (size_t i = 0; i < n; i++)
+	{
+		Compare("DecodeNative", which, description, i, result, expected);
+	}
+}
+
+void Check(const vector<string>& kernels, unsigned char* buffer, int type, size_t n, size_t offset)
+{
+	const DecodeParams p = Params(type);
+	unsigned char* src = buffer + offset;
+
+	switch (type)
+	{
+		case NC_BYTE:
+			Fill<signed char>(src, n, p);
+			break;
+		case NC_SHORT:
+			Fill<int16_t>(src, n, p);
+			break;
+		case NC_INT:
+			Fill<int32_t>(src, n, p);
+			break;
+		case NC_FLOAT:
+			Fill<float>(src, n, p);
+			break;
+		default:
+			Fill<double>(src, n, p);
+			break;
+	}
+
+	const string description = Describe(type, n, offset, p);
+	vector<float> expected(n);
+
+	const bool status = DecodeWith("scalar", src, type, n, expected.data(), p);
+
+	for (const auto& kernel : kernels)
+	{
+		vector<float> result(n);
+
+		CompareStatus("DecodeWith", kernel, description, DecodeWith(kernel, src, type, n, result.data(), p), status);
+
+		for (size_t i = 0; i < n; i++)
+		{
+			Compare("DecodeWith", kernel, description, i, result, expected);
+		}
+	}
+
+	CheckNative<float>(src, type, n, p, description);
+	CheckNative<double>(src, type, n, p, description);
+}
+}  // namespace
+
+int main(int argc, char** argv)
+{
+	const size_t count = (argc > 1) ? static_cast<size_t>(strtoull(argv[1], nullptr, 10)) : 200000;
+	const vector<string> kernels = DecodeKernels();
+	const int types[] = {NC_BYTE, NC_SHORT, NC_INT, NC_FLOAT, NC_DOUBLE};
+
+	fmt::print("Checking {} decode cases, kernel sets: {}, in use: {}\n", count, fmt::join(kernels, " "),
+	           DecodeKernel());
+
+	// 64-byte aligned so that the offsets give every alignment the kernels see
+
+	vector<uint64_t> storage((kMaxLength * sizeof(double) + kMaxOffset) / sizeof(uint64_t) + 8);
+	auto* buffer = reinterpret_cast<unsigned char*>(
+	    (reinterpret_cast<uintptr_t>(storage.data()) + 63) & ~static_cast<uintptr_t>(63));
+
+	for (size_t i = 0; i < count; i++)
+	{
+		const int type = types[Random() % 5];
+		const size_t n = (i % 4 == 3) ? Random() % (kMaxLength + 1) : Random() % 71;
+
+		Check(kernels, buffer, type, n, Random() % kMaxOffset);
+	}
+
+	fmt::print("{} comparisons, {} mismatches\n", comparisons, mismatches);
+
+	return (mismatches == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
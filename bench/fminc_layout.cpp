@@ -0,0 +1,314 @@
+/*
+ * fminc_layout.cpp
+ *
+ * Check of slice orientation: FlipX, FlipY and ForceRowMajor. Results are
+ * compared to values computed directly from grid indexes.
+ *
+ * - FlipSlice() and TransposeSlice() on their own, float and double, for all
+ *   slices up to 40 x 40 and for larger ones that are not square and not a
+ *   multiple of the block size
+ * - reads of generated classic (memory mapped) and netcdf4 files with a 7 x 5
+ *   grid, parameters stored as (t, y, x) and (t, x, y), with every
+ *   combination of FlipX, FlipY and ForceRowMajor: one slice at a time, all
+ *   times with one hyperslab, and an index window
+ *
+ * Usage: fminc_layout
+ *
+ * Exit status is nonzero if any result differs.
+ */
+
+#include "NFmiLayout.h"
+#include "NFmiNetCDF.h"
+#include <boost/filesystem.hpp>
+#include <cstdlib>
+#include <fmt/format.h>
+#include <netcdfcpp.h>
+#include <numeric>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+namespace
+{
+const size_t kMaxReported = 20;
+
+size_t comparisons = 0;
+size_t mismatches = 0;
+
+template <typename T>
+void Compare(const string& what, const vector<T>& result, const vector<T>& expected)
+{
+	comparisons++;
+
+	if (result.size() != expected.size())
+	{
+		if (mismatches++ < kMaxReported)
+		{
+			fmt::print("{}: {} values != {}\n", what, result.size(), expected.size());
+		}
+
+		return;
+	}
+
+	for (size_t i = 0; i < result.size(); i++)
+	{
+		if (result[i] != expected[i])
+		{
+			if (mismatches++ < kMaxReported)
+			{
+				fmt::print("{} [{}]: {} != {}\n", what, i, result[i], expected[i]);
+			}
+
+			return;
+		}
+	}
+}
+
+// Layout kernels
+
+template <typename T>
+void CheckKernels(size_t rows, size_t cols, vector<T>& scratch)
+{
+	const char* type = is_same<T, float>::value ? "float" : "double";
+	const size_t n = rows * cols;
+
+	vector<T> input(n);
+	iota(input.begin(), input.end(), T(0));
+
+	vector<T> expected(n);
+
+	for (size_t i = 0; i < rows; i++)
+	{
+		for (size_t j = 0; j < cols; j++)
+		{
+			expected[j * rows + i] = input[i * cols + j];
+		}
+	}
+
+	vector<T> result = input;
+	TransposeSlice(result.data(), rows, cols, scratch);
+	Compare(fmt::format("TransposeSlice<{}>({}, {})", type, rows, cols), result, expected);
+
+	for (int flips = 1; flips < 4; flips++)
+	{
+		const bool flipX = (flips & 1) != 0;
+		const bool flipY = (flips & 2) != 0;
+
+		for (size_t i = 0; i < rows; i++)
+		{
+			for (size_t j = 0; j < cols; j++)
+			{
+				expected[i * cols + j] = input[(flipY ? rows - 1 - i : i) * cols + (flipX ? cols - 1 - j : j)];
+			}
+		}
+
+		result = input;
+		FlipSlice(result.data(), rows, cols, flipX, flipY);
+		Compare(fmt::format("FlipSlice<{}>({}, {}, {:d}, {:d})", type, rows, cols, flipX, flipY), result, expected);
+	}
+}
+
+template <typename T>
+void CheckKernels()
+{
+	// one scratch for all sizes, like for the slices of one read
+
+	vector<T> scratch;
+
+	for (size_t rows = 0; rows <= 40; rows++)
+	{
+		for (size_t cols = 0; cols <= 40; cols++)
+		{
+			CheckKernels<T>(rows, cols, scratch);
+		}
+	}
+
+	const vector<pair<size_t, size_t>> sizes{{1000, 33}, {33, 1000}, {517, 301}, {301, 517},
+	                                         {64, 96},   {96, 64},   {1, 500},   {500, 1}};
+
+	for (const auto& size : sizes)
+	{
+		CheckKernels<T>(size.first, size.second, scratch);
+	}
+}
+
+// Reads of generated files
+
+const long NX = 7;
+const long NY = 5;
+const long NT = 3;
+
+float Value(long t, long x, long y)
+{
+	return static_cast<float>(t * 10000 + y * 100 + x);
+}
+
+bool Generate(const string& fileName, NcFile::FileFormat format)
+{
+	NcFile file(fileName.c_str(), NcFile::Replace, nullptr, 0, format);
+
+	if (!file.is_valid())
+	{
+		return false;
+	}
+
+	file.add_att("Conventions", "CF-1.6");
+
+	NcDim* xdim = file.add_dim("lon", NX);
+	NcDim* ydim = file.add_dim("lat", NY);
+	NcDim* tdim = file.add_dim("time");
+
+	NcVar* xvar = file.add_var("lon", ncFloat, xdim);
+	NcVar* yvar = file.add_var("lat", ncFloat, ydim);
+	NcVar* tvar = file.add_var("time", ncDouble, tdim);
+
+	xvar->add_att("standard_name", "longitude");
+	xvar->add_att("units", "degrees_east");
+	yvar->add_att("standard_name", "latitude");
+	yvar->add_att("units", "degrees_north");
+	tvar->add_att("units", "hours since 2024-01-01 00:00:00");
+	tvar->add_att("axis", "T");
+
+	NcVar* yx = file.add_var("yx", ncFloat, tdim, ydim, xdim);
+	NcVar* xy = file.add_var("xy", ncFloat, tdim, xdim, ydim);
+
+	vector<float> x(NX), y(NY);
+	vector<double> t(NT);
+
+	for (long i = 0; i < NX; i++)
+		x[static_cast<size_t>(i)] = 20.f + static_cast<float>(i);
+	for (long j = 0; j < NY; j++)
+		y[static_cast<size_t>(j)] = 60.f + static_cast<float>(j);
+
+	iota(t.begin(), t.end(), 0.);
+
+	xvar->put(x.data(), NX);
+	yvar->put(y.data(), NY);
+	tvar->put(t.data(), NT);
+
+	vector<float> yxData, xyData;
+
+	for (long k = 0; k < NT; k++)
+	{
+		for (long j = 0; j < NY; j++)
+			for (long i = 0; i < NX; i++)
+				yxData.push_back(Value(k, i, j));
+
+		for (long i = 0; i < NX; i++)
+			for (long j = 0; j < NY; j++)
+				xyData.push_back(Value(k, i, j));
+	}
+
+	yx->put(yxData.data(), NT, NY, NX);
+	xy->put(xyData.data(), NT, NX, NY);
+
+	return file.close();
+}
+
+// Window of a slice with flips applied; (y, x) order unless rowMajor is false
+
+vector<float> Expected(long t, const NFmiNetCDF::IndexWindow& w, bool rowMajor, bool flipX, bool flipY)
+{
+	vector<float> values(static_cast<size_t>(w.nx * w.ny));
+
+	for (long j = 0; j < w.ny; j++)
+	{
+		for (long i = 0; i < w.nx; i++)
+		{
+			const long x = w.x0 + (flipX ? w.nx - 1 - i : i);
+			const long y = w.y0 + (flipY ? w.ny - 1 - j : j);
+			const long index = rowMajor ? j * w.nx + i : i * w.ny + j;
+
+			values[static_cast<size_t>(index)] = Value(t, x, y);
+		}
+	}
+
+	return values;
+}
+
+void CheckFile(const string& fileName, const string& name)
+{
+	const NFmiNetCDF::IndexWindow grid{0, 0, NX, NY};
+	const NFmiNetCDF::IndexWindow window{2, 1, 4, 3};
+
+	for (int options = 0; options < 8; options++)
+	{
+		const bool flipX = (options & 1) != 0;
+		const bool flipY = (options & 2) != 0;
+		const bool forceRowMajor = (options & 4) != 0;
+
+		NFmiNetCDF nc(fileName);
+
+		nc.FlipX(flipX);
+		nc.FlipY(flipY);
+		nc.ForceRowMajor(forceRowMajor);
+
+		for (const string param : {"yx", "xy"})
+		{
+			const bool rowMajor = (param == "yx" || forceRowMajor);
+			const string what =
+			    fmt::format("{} {} flipX={:d} flipY={:d} forceRowMajor={:d}", name, param, flipX, flipY, forceRowMajor);
+
+			nc.ResetTime();
+
+			while (nc.NextTime())
+			{
+				const long t = nc.TimeIndex();
+
+				Compare(fmt::format("{} Values() time {}", what, t), nc.Values<float>(param),
+				        Expected(t, grid, rowMajor, flipX, flipY));
+			}
+
+			vector<float> expected;
+
+			for (long t = 0; t < NT; t++)
+			{
+				const auto slice = Expected(t, grid, rowMajor, flipX, flipY);
+				expected.insert(expected.end(), slice.begin(), slice.end());
+			}
+
+			Compare(what + " Values(all times)", nc.Values<float>(param, 0, NT, 0, 1), expected);
+
+			nc.ResetTime();
+			nc.NextTime();
+
+			Compare(what + " Values(window)", nc.Values<float>(param, window),
+			        Expected(0, window, rowMajor, flipX, flipY));
+		}
+	}
+}
+}  // namespace
+
+int main()
+{
+	CheckKernels<float>();
+	CheckKernels<double>();
+
+	const auto dir = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("fminc-layout-%%%%%%");
+	boost::filesystem::create_directories(dir);
+
+	const vector<pair<string, NcFile::FileFormat>> formats{{"classic", NcFile::Classic}, {"nc4", NcFile::Netcdf4}};
+
+	for (const auto& format : formats)
+	{
+		const string fileName = (dir / (format.first + ".nc")).string();
+
+		if (!Generate(fileName, format.second))
+		{
+			fmt::print("Unable to create file {}\n", fileName);
+			mismatches++;
+			continue;
+		}
+
+		CheckFile(fileName, format.first);
+	}
+
+	boost::filesystem::remove_all(dir);
+
+	fmt::print("{} comparisons, {} mismatches\n", comparisons, mismatches);
+
+	return (mismatches == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,334 @@
+/*
+ * fminc_precision.cpp
+ *
+ * Equivalence check of the numeric decimal rounding in NFmiPrecision against
+ * the text round-trip it replaced: values printed with fmt "{:.Nf}" and parsed
+ * back with strtof/strtod, and decimal counts taken from std::to_string().
+ * Improved precision is read from FMINC_USE_IMPROVED_PRECISION like in the
+ * library; 'make precision-check' runs the check with it off and on.
+ *
+ * The corpus is generated with a fixed seed:
+ *
+ * - special values: zeros, subnormals, limits, powers of two and ten
+ * - decimal coordinates and resolutions with 0..8 decimals, as float and double
+ * - halfway cases at every precision, and their float and double neighbours
+ * - dyadic fractions m / 2^k, which are exact ties when printed
+ * - random mantissas with binary exponents -80..80, and random float bit
+ *   patterns over the whole float range; the whole double range is covered by
+ *   the powers of two in the special values
+ * - random values scaled to 1e-9 .. 1e9
+ *
+ * Each value is checked as float and double input and output, at precisions
+ * 0..12 and with ToSamePrecision(). Float outputs of values beyond float range
+ * are skipped; std::stof used to throw for those.
+ *
+ * Usage: fminc_precision [count]
+ *
+ * 'count' is the number of generated values (default 2000000). Exit status is
+ * nonzero if any result differs.
+ */
+
+#include "NFmiPrecision.h"
+#include <algorithm>
+#include <atomic>
+#include <cfloat>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fmt/format.h>
+#include <limits>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+using namespace std;
+
+namespace
+{
+const int kMaxDigits = 12;
+const size_t kMaxReported = 20;
+
+const bool improved =
+    getenv("FMINC_USE_IMPROVED_PRECISION") != nullptr && getenv("FMINC_USE_IMPROVED_PRECISION")[0] == '1';
+
+atomic<size_t> comparisons(0);
+atomic<size_t> mismatches(0);
+mutex outputMutex;
+
+// Text round-trip as it was before NFmiPrecision
+
+int ReferenceDecimalDigits(const string& text)
+{
+	string str = text;
+	str.erase(str.find_last_not_of('0') + 1, string::npos);
+	const auto dot = str.find('.');
+	size_t num_digits = (dot == string::npos) ? 0 : str.length() - dot - 1;
+	num_digits = std::min(num_digits, static_cast<size_t>(8));
+	return static_cast<int>(num_digits);
+}
+
+template <typename T, typename U>
+T ReferencePrecision(U val, int num_digits)
+{
+	if (!improved)
+	{
+		return static_cast<T>(val);
+	}
+
+	const string str = fmt::format("{:.{}f}", val, num_digits);
+
+	if constexpr (is_same<T, float>::value)
+	{
+		return strtof(str.c_str(), nullptr);
+	}
+	else
+	{
+		return strtod(str.c_str(), nullptr);
+	}
+}
+
+template <typename T, typename U>
+T ReferenceSamePrecision(U val)
+{
+	return ReferencePrecision<T>(val, ReferenceDecimalDigits(to_string(val)));
+}
+
+template <typename T>
+bool Same(T a, T b)
+{
+	return (std::isnan(a) && std::isnan(b)) || memcmp(&a, &b, sizeof(T)) == 0;
+}
+
+template <typename T, typename U>
+void Compare(const char* what, U val, int num_digits, T result, T expected)
+{
+	comparisons++;
+
+	if (Same(result, expected))
+	{
+		return;
+	}
+
+	if (mismatches++ < kMaxReported)
+	{
+		lock_guard<mutex> lock(outputMutex);
+		fmt::print("{}<{}, {}>({:.17g}, {}): {:.17g} != {:.17g}\n", what, is_same<T, float>::value ? "float" : "double",
+		           is_same<U, float>::value ? "float" : "double", val, num_digits, result, expected);
+	}
+}
+
+template <typename T, typename U>
+void Check(U val)
+{
+	if (is_same<T, float>::value && std::isfinite(val) && std::fabs(static_cast<double>(val)) >= FLT_MAX)
+	{
+		return;
+	}
+
+	for (int n = 0; n <= kMaxDigits; n++)
+	{
+		Compare("ToPrecision", val, n, ToPrecision<T>(val, n), ReferencePrecision<T>(val, n));
+	}
+
+	Compare("ToSamePrecision", val, -1, ToSamePrecision<T>(val), ReferenceSamePrecision<T>(val));
+}
+
+void Check(double val)
+{
+	comparisons++;
+
+	const int digits = NumberOfDecimalDigits(val);
+	const int expected = ReferenceDecimalDigits(to_string(val));
+
+	if (digits != expected && mismatches++ < kMaxReported)
+	{
+		lock_guard<mutex> lock(outputMutex);
+		fmt::print("NumberOfDecimalDigits({:.17g}): {} != {}\n", val, digits, expected);
+	}
+
+	Check<float>(val);
+	Check<double>(val);
+
+	if (!std::isfinite(val) || std::fabs(val) < FLT_MAX)
+	{
+		const float fval = static_cast<float>(val);
+
+		Check<float>(fval);
+		Check<double>(fval);
+	}
+}
+
+// xorshift64*, fixed seed so that every run checks the same values
+
+uint64_t state = 0x9e3779b97f4a7c15ULL;
+
+uint64_t Random()
+{
+	state ^= state >> 12;
+	state ^= state << 25;
+	state ^= state >> 27;
+	return state * 0x2545f4914f6cdd1dULL;
+}
+
+double Uniform()
+{
+	return static_cast<double>(Random() >> 11) / 9007199254740992.0;
+}
+
+vector<double> SpecialValues()
+{
+	vector<double> values = {0.0,
+	                         -0.0,
+	                         numeric_limits<double>::infinity(),
+	                         -numeric_limits<double>::infinity(),
+	                         numeric_limits<double>::quiet_NaN(),
+	                         numeric_limits<double>::min(),
+	                         numeric_limits<double>::denorm_min(),
+	                         numeric_limits<double>::max(),
+	                         numeric_limits<double>::epsilon(),
+	                         static_cast<double>(numeric_limits<float>::min()),
+	                         static_cast<double>(numeric_limits<float>::denorm_min()),
+	                         static_cast<double>(numeric_limits<float>::max()),
+	                         static_cast<double>(numeric_limits<float>::epsilon()),
+	                         32700.0,
+	                         0.1,
+	                         0.2,
+	                         0.3,
+	                         0.0625,
+	                         0.025,
+	                         0.05,
+	                         0.125,
+	                         2.5,
+	                         1.0000001,
+	                         0.9999999,
+	                         0.0000005,
+	                         0.0000015,
+	                         0.00000049999999999999999};
+
+	for (int e = -1074; e <= 1023; e++)
+	{
+		values.push_back(std::ldexp(1.0, e));
+		values.push_back(std::nextafter(std::ldexp(1.0, e), 0.0));
+	}
+
+	for (int e = -20; e <= 20; e++)
+	{
+		values.push_back(std::pow(10.0, e));
+	}
+
+	return values;
+}
+
+void CheckValue(double val)
+{
+	Check(val);
+	Check(-val);
+}
+
+vector<double> Corpus(size_t count)
+{
+	vector<double> values = SpecialValues();
+
+	for (size_t i = 0; i < count; i++)
+	{
+		double val = 0;
+
+		switch (i % 6)
+		{
+			case 0:
+			{
+				// decimal coordinate or resolution with 0..8 decimals
+				const int decimals = static_cast<int>(Random() % 9);
+				const double range = (Random() % 2) ? 360 : 1e6;
+				val = std::round(Uniform() * range * std::pow(10.0, decimals)) / std::pow(10.0, decimals);
+				break;
+			}
+			case 1:
+			{
+				// halfway between two values with n decimals, and its neighbours
+				const int decimals = static_cast<int>(Random() % (kMaxDigits + 1));
+				const double scale = std::pow(10.0, decimals);
+				val = (std::floor(Uniform() * 1e4) + 0.5) / scale;
+
+				if (Random() % 3 == 0)
+				{
+					val = std::nextafter(val, 0.0);
+				}
+				else if (Random() % 2 == 0)
+				{
+					val = std::nextafter(val, 1e300);
+				}
+
+				break;
+			}
+			case 2:
+			{
+				// dyadic fraction
+				val = std::ldexp(static_cast<double>(Random() % 100000), -static_cast<int>(Random() % 40));
+				break;
+			}
+			case 3:
+			{
+				// random mantissa bits, exponent -80..80
+				const auto mantissa = static_cast<double>(Random() >> 11);
+				val = std::ldexp(mantissa, static_cast<int>(Random() % 161) - 80 - 53);
+				break;
+			}
+			case 4:
+			{
+				// random float bit pattern; mostly very small or large values
+				uint32_t bits = static_cast<uint32_t>(Random());
+				float fval;
+				memcpy(&fval, &bits, sizeof(fval));
+				val = fval;
+				break;
+			}
+			default:
+				val = Uniform() * std::pow(10.0, static_cast<int>(Random() % 19) - 9);
+				break;
+		}
+
+		values.push_back(val);
+	}
+
+	return values;
+}
+}  // namespace
+
+int main(int argc, char** argv)
+{
+	const size_t count = (argc > 1) ? static_cast<size_t>(strtoull(argv[1], nullptr, 10)) : 2000000;
+	const vector<double> values = Corpus(count);
+
+	fmt::print("Checking decimal rounding of {} values, improved precision {}\n", values.size(),
+	           improved ? "on" : "off");
+
+	atomic<size_t> next(0);
+
+	auto worker = [&]()
+	{
+		for (size_t i = next++; i < values.size(); i = next++)
+		{
+			CheckValue(values[i]);
+		}
+	};
+
+	vector<thread> threads;
+
+	for (unsigned int i = 0; i < std::max(1u, thread::hardware_concurrency()); i++)
+	{
+		threads.emplace_back(worker);
+	}
+
+	for (auto& t : threads)
+	{
+		t.join();
+	}
+
+	fmt::print("{} comparisons, {} mismatches\n", comparisons.load(), mismatches.load());
+
+	return (mismatches == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
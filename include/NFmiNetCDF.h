@@ -4,12 +4,22 @@
  * General library to access NetCDF files.
  */
 
+#ifndef NFMINETCDF_H
+#define NFMINETCDF_H
+
 #include <cassert>
+#include <cstdint>
 #include <memory>
+#include <mutex>
 #include <netcdfcpp.h>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
+class NFmiClassicFile;
+class NFmiSliceCache;
+struct DecodeParams;
+
 class NFmiNetCDF
 {
    public:
@@ -19,6 +29,74 @@ class NFmiNetCDF
 
 	static const float kFloatMissing;
 
+	// Attribute values are parsed once when file is opened: text attributes
+	// are in 'text', all numeric types are stored as double in 'values'
+
+	struct Attribute
+	{
+		nc_type type;
+		std::string text;
+		std::vector<double> values;
+	};
+
+	// Output file options for WriteSlice() and WriteSlices(). Compression and
+	// quantization need netcdf4 format; chunking matches one (y, x) slice
+	// (1, .., 1, ny, nx) unless chunkSlices is false.
+
+	struct WriteOptions
+	{
+		bool netcdf4 = false;
+		int deflateLevel = 0;     // 0 (off) .. 9
+		bool shuffle = false;
+		bool chunkSlices = true;
+		int quantizeDigits = 0;  // significant digits kept with bit-grooming, 0 = lossless
+		bool packShorts = false;  // store float/double parameters as shorts with scale_factor and add_offset
+	};
+
+	struct SliceRequest
+	{
+		std::string param;
+		long timeIndex;
+		long levelIndex;
+	};
+
+	// Sub-domain of the grid: columns [x0, x0 + nx) and rows [y0, y0 + ny) in
+	// grid index space of the file (not affected by FlipX/FlipY). Flips are
+	// applied to the values inside the window.
+
+	struct IndexWindow
+	{
+		long x0;
+		long y0;
+		long nx;
+		long ny;
+	};
+
+	// Geographic bounds in degrees; minLon > maxLon crosses the antimeridian
+
+	struct BoundingBox
+	{
+		double minLat;
+		double minLon;
+		double maxLat;
+		double maxLon;
+	};
+
+	struct LatLon
+	{
+		double lat;
+		double lon;
+	};
+
+	// Location in grid index space of the file (not affected by FlipX/FlipY);
+	// fractional values are used for interpolation
+
+	struct GridPoint
+	{
+		double x;
+		double y;
+	};
+
 	bool Read(const std::string& theInfile);
 
 	long int SizeX() const;
@@ -42,11 +120,32 @@ class NFmiNetCDF
 	long TimeIndex();
 	std::string TimeUnit();
 
+	// Time axis is read from file once, on first access. Values are in the
+	// units given by TimeUnit().
+
+	const std::vector<double>& Times();
+
+	template <typename T>
+	T Time(long theIndex);
+
+	// Index of given time value, or -1 if it's not found
+	long FindTime(double theTime);
+
 	void ResetLevel();
 	bool NextLevel();
 	float Level();
 	long LevelIndex();
 
+	// Level axis is read from file once, on first access
+
+	const std::vector<float>& Levels();
+	float Level(long theIndex);
+
+	// Index of given level value (exact match or closest one), or -1 if
+	// file has no levels or value is not found
+	long FindLevel(float theLevel);
+	long FindNearestLevel(float theLevel);
+
 	void FirstParam();
 	bool NextParam();
 	NcVar* Param();
@@ -77,7 +176,153 @@ class NFmiNetCDF
 	template <typename T>
 	std::vector<T> Values();
 
+	// Read current slice of a parameter resolved earlier with GetVariable();
+	// saves the name lookup when the same parameter is read repeatedly
+
+	template <typename T>
+	std::vector<T> Values(NcVar* theParameter);
+
+	template <typename T>
+	bool Values(NcVar* theParameter, T* theBuffer, size_t theSize);
+
+	// Fill caller-owned buffer with the current slice; buffer must hold
+	// at least SliceSize() elements. Buffer can be reused between slices.
+
+	template <typename T>
+	bool Values(const std::string& theParameter, T* theBuffer, size_t theSize);
+
+	template <typename T>
+	bool Values(T* theBuffer, size_t theSize);
+
+	// Current slice as a shared immutable buffer, or nullptr if parameter is not
+	// found or can not be read. With a slice cache, a cached slice is returned
+	// without copying.
+
+	template <typename T>
+	std::shared_ptr<const std::vector<T>> SharedValues(const std::string& theParameter);
+
+	size_t SliceSize(const std::string& theParameter);
+	size_t SliceSize();
+
+	// Read times [theFirstTime, theFirstTime + theTimeCount) and levels
+	// [theFirstLevel, theFirstLevel + theLevelCount) of a parameter with a single
+	// hyperslab request. Values are in the dimension order of the variable,
+	// usually (t, z, y, x). Level range is ignored if parameter has no z dimension.
+
+	template <typename T>
+	std::vector<T> Values(const std::string& theParameter, long theFirstTime, long theTimeCount, long theFirstLevel,
+	                      long theLevelCount);
+
+	template <typename T>
+	bool Values(const std::string& theParameter, long theFirstTime, long theTimeCount, long theFirstLevel,
+	            long theLevelCount, T* theBuffer, size_t theSize);
+
+	size_t SliceSize(const std::string& theParameter, long theTimeCount, long theLevelCount);
+
+	// Read current time and level of a parameter inside an index window with a
+	// single hyperslab request. Buffer must hold at least nx * ny elements.
+
+	template <typename T>
+	std::vector<T> Values(const std::string& theParameter, const IndexWindow& theWindow);
+
+	template <typename T>
+	bool Values(const std::string& theParameter, const IndexWindow& theWindow, T* theBuffer, size_t theSize);
+
+	// Smallest index window containing all grid points inside a lat/lon box.
+	// Uses the x and y axes of latitude_longitude grids, otherwise 2D latitude and
+	// longitude variables; both are read once and cached. Returns false if no
+	// grid point is inside the box.
+
+	bool FindWindow(const BoundingBox& theBox, IndexWindow& theWindow);
+
+	template <typename T>
+	std::vector<T> Values(const std::string& theParameter, const BoundingBox& theBox);
+
+	// Grid locations of lat/lon points on latitude_longitude grids, from the cached
+	// x and y axes. Points outside the grid (or all points, if grid is in some other
+	// projection) get x = y = -1.
+
+	std::vector<GridPoint> FindGridPoints(const std::vector<LatLon>& thePoints);
+
+	// Time series of a parameter at a list of points: times [theFirstTime,
+	// theFirstTime + theTimeCount) at level theLevelIndex (ignored if parameter has
+	// no z dimension). Result is a points x times matrix, row for each point.
+	// Values are bilinearly interpolated if theInterpolate is set, otherwise taken
+	// from the nearest grid point. Points outside the grid give kFloatMissing, as do
+	// missing values and interpolated points with a missing neighbour. Fill values
+	// (_FillValue, missing_value) are missing also when values are not unpacked.
+	//
+	// Points close to each other are read with a single window per time step,
+	// scattered points with one small hyperslab over all times each.
+
+	template <typename T>
+	std::vector<T> PointValues(const std::string& theParameter, const std::vector<GridPoint>& thePoints,
+	                           long theFirstTime, long theTimeCount, long theLevelIndex = -1,
+	                           bool theInterpolate = false);
+
+	template <typename T>
+	std::vector<T> PointValues(const std::string& theParameter, const std::vector<LatLon>& thePoints,
+	                           long theFirstTime, long theTimeCount, long theLevelIndex = -1,
+	                           bool theInterpolate = false);
+
+	// Read a list of slices concurrently. Requests do not use or modify the
+	// param/time/level iterators. Each worker thread opens its own handle to the
+	// file; theThreadCount == 0 means one thread per hardware core.
+	// Results are in the same order as requests; unknown parameters and failed
+	// reads print an error and give an empty vector.
+
+	template <typename T>
+	std::vector<std::vector<T>> Values(const std::vector<SliceRequest>& theRequests, unsigned int theThreadCount = 0);
+
+	// Read one requested slice without using the iterators. Values are resized to
+	// the slice size, so a buffer can be reused between requests. On error values
+	// are empty and false is returned.
+
+	template <typename T>
+	bool Values(const SliceRequest& theRequest, std::vector<T>& theValues);
+
+	// New instance of the same file with the same read options, for use in
+	// another thread; nullptr if file can not be read.
+
+	std::unique_ptr<NFmiNetCDF> Reopen() const;
+
 	bool WriteSlice(const std::string& theFileName);
+	bool WriteSlice(const std::string& theFileName, const WriteOptions& theOptions);
+
+	// Write selected parameters, times and levels (given as indexes) to one file.
+	// Empty selection means all parameters/times/levels. With packShorts the
+	// selected data of each packed parameter is read twice: first for its value
+	// range, as the packing attributes must be defined before any data is
+	// written, and then for writing.
+
+	bool WriteSlices(const std::string& theFileName, const std::vector<std::string>& theParameters,
+	                 const std::vector<long>& theTimeIndexes = std::vector<long>(),
+	                 const std::vector<long>& theLevelIndexes = std::vector<long>());
+	bool WriteSlices(const std::string& theFileName, const std::vector<std::string>& theParameters,
+	                 const std::vector<long>& theTimeIndexes, const std::vector<long>& theLevelIndexes,
+	                 const WriteOptions& theOptions);
+
+	// Default options for writes without explicit options
+	const WriteOptions& GetWriteOptions() const;
+	void SetWriteOptions(const WriteOptions& theOptions);
+
+	// Maximum amount of memory (bytes) used to copy data of one variable
+	// when writing. Larger variables are copied in pieces.
+
+	size_t CopyBufferSize() const;
+	void CopyBufferSize(size_t theSize);
+
+	// netcdf4 chunk cache of each parameter variable: size in bytes, number
+	// of chunk slots and preemption (0..1). Applies also to files read later.
+	// Zero size keeps library defaults. No effect on classic files.
+
+	void ChunkCache(size_t theSize, size_t theSlots = 1009, float thePreemption = 0.75f);
+
+	// Orientation of read values. FlipX reverses the x axis (each row) and FlipY the
+	// y axis (order of rows) of every slice. With ForceRowMajor, parameters stored as
+	// (x, y) are transposed to (y, x) so that slices are always row-major; otherwise
+	// values keep the dimension order of the file. Coordinate accessors and writes
+	// are not affected.
 
 	bool FlipX();
 	void FlipX(bool theXFlip);
@@ -85,11 +330,81 @@ class NFmiNetCDF
 	bool FlipY();
 	void FlipY(bool theYFlip);
 
+	bool ForceRowMajor() const;
+	void ForceRowMajor(bool theForceRowMajor);
+
+	// CF unpacking of read values: value = stored * scale_factor + add_offset, and
+	// stored values equal to _FillValue or missing_value are returned as kFloatMissing.
+	// Fill values are compared in the stored type, whether the file is read from a
+	// memory mapping or through the library. Off by default, when stored values are
+	// returned as is.
+
+	bool Unpack() const;
+	void Unpack(bool theUnpack);
+
+	// Directory for metadata sidecar files. When set, metadata derived by Read()
+	// (dimension and variable roles, parameters, attributes) is stored per data
+	// file and reused while path, size and modification time of the file are
+	// unchanged. Time and level axes and resolution are added to the sidecar
+	// when the instance is destroyed, if they were read. Empty disables the
+	// cache; default is taken from FMINC_METADATA_CACHE environment variable.
+
+	const std::string& MetadataCache() const;
+	void MetadataCache(const std::string& theDirectory);
+
+	// Cache for decoded slices read with Values(), shared by instances that
+	// set the same cache (for example NFmiSliceCache::Instance()). nullptr
+	// (default) disables caching. Only single-slice reads are cached.
+
+	NFmiSliceCache* SliceCache() const;
+	void SliceCache(NFmiSliceCache* theCache);
+
+	// Approximate heap memory used by cached metadata, coordinates and axes
+
+	size_t MemoryUsage() const;
+
+	// netcdf library is not thread safe, so all calls to it are serialized with
+	// this mutex. Methods take it themselves for their library calls: separate
+	// instances can be used in separate threads without further locking, but an
+	// instance must be used by one thread at a time. The methods that call the
+	// library are:
+	//
+	// - Read() (and the constructor that reads a file), the destructor, Reopen()
+	// - WriteSlice(), WriteSlices()
+	// - slice reads (Values(), SharedValues(), PointValues()) when they go
+	//   through the library; reads of memory mapped classic files do not take
+	//   the mutex and run in parallel
+	// - lazy loaders of axes and coordinates, on first use: Times(), Levels() and
+	//   the time and level accessors using them, Validate(), [XY]Resolution(),
+	//   FindWindow(), FindGridPoints()
+	// - X0(), Y0(), X1(), Y1(), Lat0(), Lon0(), Type[XYZT](), ChunkCache(),
+	//   HasDimension(), CoordinatesInRowMajorOrder(), Att(NcVar*, ...)
+	//
+	// Size[XYZT]() and the other metadata accessors use values cached by Read().
+	//
+	// The mutex is recursive, so it can be held while calling any method. It must
+	// be held for direct library calls through the NcVar and NcFile objects given
+	// out by Param() and GetVariable().
+
+	static std::recursive_mutex& LibraryMutex();
+
 	double XResolution();
 	double YResolution();
 
+	// Check that x and y coordinates are evenly spaced. Reads the full coordinate
+	// variables, so it is not done when file is opened but on first call to
+	// Validate() or [XY]Resolution(). Returns false if resolution is not constant.
+
+	bool Validate();
+
 	NcVar* GetVariable(const std::string& varName) const;
 	bool HasVariable(const std::string& name) const;
+
+	// Parameter existence, and whether it has the z dimension. These do not
+	// call the netcdf library.
+
+	bool HasParameter(const std::string& theParameter) const;
+	bool HasLevels(const std::string& theParameter) const;
 	bool CoordinatesInRowMajorOrder(const NcVar* var);
 
 	bool HasDimension(const std::string& dimName);
@@ -98,15 +413,62 @@ class NFmiNetCDF
 	NcVar* GetProjectionVariable() const;
 	static std::string Att(NcVar* var, const std::string& attName);
 
+	// Cached attribute accessors; GetAtt() returns nullptr if attribute does not exist
+
+	const Attribute* GetAtt(const NcVar* var, const std::string& attName) const;
+	std::string AttText(const NcVar* var, const std::string& attName) const;
+	double AttValue(const NcVar* var, const std::string& attName, double defaultValue = kFloatMissing) const;
+
    private:
 	bool HasDimension(const NcVar* var, const std::string& dim);
 
 	template <typename T>
 	std::vector<T> Values(NcVar* var, long timeIndex, long levelIndex = -1);
 
+	template <typename T>
+	bool Values(NcVar* var, long timeIndex, long levelIndex, T* theBuffer, size_t theSize, long timeCount = 1,
+	            long levelCount = 1, const IndexWindow* window = nullptr);
+
+	size_t SliceShape(const NcVar* var, long timeIndex, long levelIndex, size_t* cursor_position, size_t* dimsizes,
+	                  long timeCount = 1, long levelCount = 1, const IndexWindow* window = nullptr) const;
+
+	template <typename T>
+	bool ReadSlice(NcVar* var, long timeIndex, long levelIndex, T* theBuffer, size_t theSize, long timeCount,
+	               long levelCount, const IndexWindow* window);
+
+	std::string SliceKey(const NcVar* var, long timeIndex, long levelIndex, size_t typeSize);
+
+	template <typename T>
+	bool ReadSlab(const NcVar* var, const size_t* start, const size_t* count, T* theBuffer, size_t theSize,
+	              const DecodeParams& theParams);
+
+	template <typename T>
+	void Orient(const NcVar* var, T* theBuffer, size_t theSize, size_t nx, size_t ny) const;
+
+	bool ValidWindow(const IndexWindow& theWindow) const;
+	bool ReadGeographicAxes();
+
+	NcVar* FindParameter(const std::string& theParameter) const;
+
+	bool DefineStorage(NcFile* theOutFile, NcVar* newvar, const NcVar* oldvar, const WriteOptions& theOptions,
+	                   bool chunkSlices) const;
+	bool WritePacked(const NcVar* var, NcVar* outvar, int outNcid, const std::vector<long>& times,
+	                 const std::vector<long>& levels, const std::vector<std::pair<size_t, size_t>>& slices,
+	                 const std::pair<double, double>& packing);
+
 	bool ReadDimensions();
 	bool ReadVariables();
 	bool ReadAttributes();
+	void CacheAttributes(const NcVar* var);
+	bool CacheShapes();
+	long DimSize(const NcDim* dim) const;
+	void SetChunkCache();
+	void SortLevels();
+
+	bool LoadMetadata();
+	void SaveMetadata();
+	void UpdateMetadata();
+	int MetadataState() const;
 
 	NcDim* itsTDim;
 	NcDim* itsXDim;
@@ -115,6 +477,25 @@ class NFmiNetCDF
 	NcDim* itsMDim;
 
 	std::unique_ptr<NcFile> itsDataFile;
+	std::string itsFileName;
+
+	// memory mapped view of classic format files, used for data reads
+	std::unique_ptr<NFmiClassicFile> itsClassicFile;
+
+	// directory of metadata sidecars, empty if not used
+	std::string itsMetadataCache;
+
+	// identity of the file when it was read, and the lazily read parts in its
+	// sidecar as given by MetadataState(); -1 if sidecar is not used
+	std::string itsFilePath;
+	uint64_t itsFileSize;
+	int64_t itsFileMTime;
+	int itsSavedMetadata;
+
+	NFmiSliceCache* itsSliceCache;
+
+	// identity of the file in slice cache keys, set on first use
+	std::string itsFileKey;
 
 	std::string itsConvention;
 	std::string itsProjection;
@@ -122,6 +503,18 @@ class NFmiNetCDF
 
 	std::vector<NcVar*> itsParameters;
 	std::vector<NcVar*>::iterator itsParamIterator;
+
+	std::unordered_map<std::string, NcVar*> itsParameterIndex;
+	std::unordered_map<std::string, NcVar*> itsVariableIndex;
+
+	// attributes of each variable, indexed by variable id
+	std::vector<std::unordered_map<std::string, Attribute>> itsAttributes;
+
+	// dimension ids of each variable by variable id, and dimension sizes by
+	// dimension id; slice shapes are computed from these without library calls
+	std::vector<std::vector<int>> itsVariableDims;
+	std::vector<long> itsDimSizes;
+
 	NcVar* itsZVar;
 	NcVar* itsXVar;
 	NcVar* itsYVar;
@@ -131,8 +524,39 @@ class NFmiNetCDF
 
 	bool itsXFlip;
 	bool itsYFlip;
+	bool itsForceRowMajor;
+	bool itsUnpack;
+
+	size_t itsCopyBufferSize;
+	WriteOptions itsWriteOptions;
+
+	size_t itsChunkCacheSize;
+	size_t itsChunkCacheSlots;
+	float itsChunkCachePreemption;
+
+	std::vector<double> itsTimes;
+	bool itsTimesSorted;
+
+	std::vector<float> itsLevels;
+	std::vector<std::pair<float, long>> itsSortedLevels;
+
+	// longitude and latitude of grid points for FindWindow(): axis values of
+	// latitude_longitude grids, or 2D variables in (y, x) order otherwise
+	std::vector<double> itsLongitudes;
+	std::vector<double> itsLatitudes;
+
+	bool itsValidated;
+	float itsXResolutionDrift;
+	float itsYResolutionDrift;
+
+	bool itsXResolutionCached;
+	bool itsYResolutionCached;
+	double itsXResolution;
+	double itsYResolution;
 
 	long itsParamIndex;
 	long itsTimeIndex;
 	long itsLevelIndex;
 };
+
+#endif /* NFMINETCDF_H */
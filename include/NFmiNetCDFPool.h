@@ -0,0 +1,136 @@
+/*
+ * class NFmiNetCDFPool
+ *
+ * Thread-safe pool of opened NFmiNetCDF instances. Files are opened and their
+ * metadata parsed once, then reused by later requests for the same file.
+ *
+ * Get() hands out an instance for exclusive use; it returns to the pool when
+ * the last copy of the returned pointer goes away. Concurrent requests for
+ * the same file get separate instances. Idle instances are kept in LRU order
+ * and the least recently used ones are closed when the pool exceeds its limit
+ * on number of open instances or on their memory use. A file is reopened if
+ * its size or modification time has changed.
+ *
+ * The pool is divided into independently locked shards by file name, so
+ * requests for different files rarely contend. Limits apply to the whole
+ * pool: when it is over a limit, the least recently used instances of any
+ * shard are closed.
+ */
+
+#ifndef NFMINETCDFPOOL_H
+#define NFMINETCDFPOOL_H
+
+#include "NFmiNetCDF.h"
+#include <atomic>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+class NFmiNetCDFPool
+{
+   public:
+	// theMaxFiles: open instances kept idle in the pool; zero disables pooling,
+	// so released instances are closed at once. theMaxBytes: their memory use as
+	// given by NFmiNetCDF::MemoryUsage(); zero means no limit.
+
+	NFmiNetCDFPool(size_t theMaxFiles = 256, size_t theMaxBytes = 0);
+	~NFmiNetCDFPool();
+
+	NFmiNetCDFPool(const NFmiNetCDFPool&) = delete;
+	NFmiNetCDFPool& operator=(const NFmiNetCDFPool&) = delete;
+
+	// Process-wide pool. Limits can be given with FMINC_POOL_MAX_FILES and
+	// FMINC_POOL_MAX_BYTES environment variables.
+
+	static NFmiNetCDFPool& Instance();
+
+	// Opened instance of a file, or nullptr if it can not be read. The param, time
+	// and level iterators are in whatever state the previous user left them.
+	// Returned pointers must not outlive the pool. Instances can be used in
+	// separate threads at once, see NFmiNetCDF::LibraryMutex().
+
+	std::shared_ptr<NFmiNetCDF> Get(const std::string& theFileName);
+
+	void Limits(size_t theMaxFiles, size_t theMaxBytes);
+
+	// Close all idle instances
+
+	void Clear();
+
+	size_t Size() const;
+	size_t Bytes() const;
+
+	size_t Hits() const;
+	size_t Misses() const;
+
+   private:
+	struct Identity
+	{
+		uint64_t size;
+		int64_t mtime;
+
+		bool operator==(const Identity& other) const
+		{
+			return size == other.size && mtime == other.mtime;
+		}
+	};
+
+	struct Entry
+	{
+		std::string fileName;
+		Identity identity;
+		std::vector<std::unique_ptr<NFmiNetCDF>> idle;
+		std::vector<size_t> bytes;
+
+		// pool-wide use counter value when last used
+		uint64_t lastUse;
+	};
+
+	struct Shard
+	{
+		mutable std::mutex mutex;
+
+		// most recently used first
+		std::list<Entry> lru;
+		std::unordered_map<std::string, std::list<Entry>::iterator> index;
+	};
+
+	static const size_t kShards = 16;
+
+	Shard& ShardOf(const std::string& theFileName);
+
+	void Release(const std::string& theFileName, const Identity& theIdentity, std::unique_ptr<NFmiNetCDF> theFile);
+
+	// Move idle instances of an entry to 'closed', so that they can be destroyed
+	// without holding the shard lock. Shard lock must be held.
+
+	void Drop(Entry& theEntry, std::vector<std::unique_ptr<NFmiNetCDF>>& closed);
+
+	// Close least recently used instances of all shards until the pool is
+	// within its limits. No shard lock may be held.
+
+	void Evict();
+	bool OverLimits() const;
+
+	static bool Stat(const std::string& theFileName, Identity& theIdentity);
+
+	Shard itsShards[kShards];
+
+	std::atomic<size_t> itsMaxFiles;
+	std::atomic<size_t> itsMaxBytes;
+
+	// idle instances and their memory use over all shards, updated holding
+	// the lock of the shard that changes
+	std::atomic<size_t> itsCount;
+	std::atomic<size_t> itsBytes;
+	std::atomic<uint64_t> itsClock;
+
+	std::atomic<size_t> itsHits;
+	std::atomic<size_t> itsMisses;
+};
+
+#endif /* NFMINETCDFPOOL_H */
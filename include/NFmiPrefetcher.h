@@ -0,0 +1,89 @@
+/*
+ * class NFmiPrefetcher
+ *
+ * Asynchronous iteration over a list of slices. A background thread reads
+ * and decodes the slices in request order, up to 'depth' slices ahead of the
+ * caller, so that reading the next slices overlaps with processing the
+ * current one:
+ *
+ *   NFmiPrefetcher<float> it(nc, NFmiPrefetcher<float>::AllSlices(nc, {"T-K"}), 4);
+ *
+ *   while (it.Next())
+ *   {
+ *       Process(it.Request(), it.Values());
+ *   }
+ *
+ * The background thread uses its own handle to the file, with the read
+ * options (unpacking, flips, caches) of the instance given to the constructor.
+ * Buffers are recycled: the values of the previous slice are reused for a
+ * later one when Next() is called.
+ *
+ * Reads of the background thread that go through the netcdf library (netcdf4
+ * files) hold NFmiNetCDF::LibraryMutex(). The caller's instance can be used
+ * while iterating, for example for Time() or Level() of the current request:
+ * its methods take the same mutex for their library calls. Direct library
+ * calls through NcVar objects must hold it.
+ */
+
+#ifndef NFMIPREFETCHER_H
+#define NFMIPREFETCHER_H
+
+#include "NFmiNetCDF.h"
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+template <typename T>
+class NFmiPrefetcher
+{
+   public:
+	NFmiPrefetcher(const NFmiNetCDF& theFile, const std::vector<NFmiNetCDF::SliceRequest>& theRequests,
+	               size_t theDepth = 2);
+	~NFmiPrefetcher();
+
+	NFmiPrefetcher(const NFmiPrefetcher&) = delete;
+	NFmiPrefetcher& operator=(const NFmiPrefetcher&) = delete;
+
+	// Move to the next slice; false when all slices have been returned, or if
+	// file could not be opened
+
+	bool Next();
+
+	// Request and values of current slice. Values are empty if the slice could
+	// not be read, and valid until the next call to Next().
+
+	const NFmiNetCDF::SliceRequest& Request() const;
+	const std::vector<T>& Values() const;
+
+	// Requests for all times of the given parameters, time by time: for each time
+	// every parameter, and for each parameter every level. Unknown parameters
+	// are left out.
+
+	static std::vector<NFmiNetCDF::SliceRequest> AllSlices(const NFmiNetCDF& theFile,
+	                                                       const std::vector<std::string>& theParameters);
+
+   private:
+	void Run();
+
+	std::unique_ptr<NFmiNetCDF> itsFile;
+	std::vector<NFmiNetCDF::SliceRequest> itsRequests;
+	size_t itsDepth;
+
+	std::thread itsThread;
+	std::mutex itsMutex;
+	std::condition_variable itsCondition;
+
+	// slices read ahead, in request order, and buffers free for reuse
+	std::deque<std::vector<T>> itsReady;
+	std::vector<std::vector<T>> itsFree;
+
+	std::vector<T> itsCurrent;
+	size_t itsReturned;
+	bool itsStop;
+};
+
+#endif /* NFMIPREFETCHER_H */
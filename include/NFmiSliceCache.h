@@ -0,0 +1,85 @@
+/*
+ * class NFmiSliceCache
+ *
+ * Thread-safe in-process cache of decoded slices. Slices are held as shared
+ * immutable buffers, so a cached slice can be handed to any number of
+ * readers without copying; eviction only drops the cache's reference.
+ *
+ * Least recently used slices are evicted when the total size exceeds the
+ * byte budget. NFmiNetCDF uses a cache set with NFmiNetCDF::SliceCache(),
+ * keyed on file identity (path, size, modification time), parameter, time and
+ * level index, value type and read options.
+ */
+
+#ifndef NFMISLICECACHE_H
+#define NFMISLICECACHE_H
+
+#include <atomic>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+class NFmiSliceCache
+{
+   public:
+	NFmiSliceCache(size_t theMaxBytes);
+
+	NFmiSliceCache(const NFmiSliceCache&) = delete;
+	NFmiSliceCache& operator=(const NFmiSliceCache&) = delete;
+
+	// Process-wide cache, byte budget from FMINC_SLICE_CACHE_BYTES environment
+	// variable (default 256 MB)
+
+	static NFmiSliceCache& Instance();
+
+	// Cached slice, or nullptr. T must be the type the slice was inserted with;
+	// it is part of the key NFmiNetCDF uses.
+
+	template <typename T>
+	std::shared_ptr<const std::vector<T>> Find(const std::string& theKey);
+
+	// Slices larger than the whole budget are not cached
+
+	template <typename T>
+	void Insert(const std::string& theKey, const std::shared_ptr<const std::vector<T>>& theValues);
+
+	size_t MaxBytes() const;
+	void MaxBytes(size_t theMaxBytes);
+
+	void Clear();
+
+	size_t Size() const;
+	size_t Bytes() const;
+
+	size_t Hits() const;
+	size_t Misses() const;
+
+   private:
+	struct Entry
+	{
+		std::string key;
+		std::shared_ptr<const void> values;
+		size_t bytes;
+	};
+
+	std::shared_ptr<const void> FindEntry(const std::string& theKey);
+	void InsertEntry(const std::string& theKey, std::shared_ptr<const void> theValues, size_t theBytes);
+	void Evict(std::vector<std::shared_ptr<const void>>& evicted);
+
+	mutable std::mutex itsMutex;
+
+	// most recently used first
+	std::list<Entry> itsLru;
+	std::unordered_map<std::string, std::list<Entry>::iterator> itsIndex;
+
+	size_t itsBytes;
+	size_t itsMaxBytes;
+
+	std::atomic<size_t> itsHits;
+	std::atomic<size_t> itsMisses;
+};
+
+#endif /* NFMISLICECACHE_H */
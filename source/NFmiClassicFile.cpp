@@ -0,0 +1,420 @@
+#include "NFmiClassicFile.h"
+#include <cstring>
+#include <fcntl.h>
+#include <netcdf.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+// Tags of the classic format specification
+
+const uint32_t CDF_DIMENSION = 0x0A;
+const uint32_t CDF_VARIABLE = 0x0B;
+const uint32_t CDF_ATTRIBUTE = 0x0C;
+const uint32_t CDF_STREAMING = 0xFFFFFFFF;
+
+size_t TypeSize(uint32_t type)
+{
+	switch (type)
+	{
+		case NC_BYTE:
+		case NC_CHAR:
+			return 1;
+		case NC_SHORT:
+			return 2;
+		case NC_INT:
+		case NC_FLOAT:
+			return 4;
+		case NC_DOUBLE:
+			return 8;
+		default:
+			return 0;
+	}
+}
+
+size_t Padded(size_t n)
+{
+	return (n + 3) & ~size_t(3);
+}
+
+// Bounds checked reader for the header
+
+struct HeaderReader
+{
+	const unsigned char* data;
+	size_t size;
+	size_t pos;
+
+	bool Get32(uint32_t& value)
+	{
+		if (pos + 4 > size)
+			return false;
+
+		value = LoadBigEndian<uint32_t>(data + pos);
+		pos += 4;
+		return true;
+	}
+
+	bool Get64(uint64_t& value)
+	{
+		if (pos + 8 > size)
+			return false;
+
+		value = LoadBigEndian<uint64_t>(data + pos);
+		pos += 8;
+		return true;
+	}
+
+	bool Skip(size_t n)
+	{
+		if (n > size - pos)
+			return false;
+
+		pos += n;
+		return true;
+	}
+
+	// each list element takes at least eight bytes of header
+	bool Fits(uint32_t nelems) const
+	{
+		return nelems <= (size - pos) / 8;
+	}
+
+	bool SkipName()
+	{
+		uint32_t len;
+		return Get32(len) && Skip(Padded(len));
+	}
+
+	bool SkipAttributes()
+	{
+		uint32_t tag, nelems;
+
+		if (!Get32(tag) || !Get32(nelems) || (tag != CDF_ATTRIBUTE && (tag != 0 || nelems != 0)))
+			return false;
+
+		for (uint32_t i = 0; i < nelems; i++)
+		{
+			uint32_t type, len;
+
+			if (!SkipName() || !Get32(type) || !Get32(len) || TypeSize(type) == 0 ||
+			    !Skip(Padded(TypeSize(type) * len)))
+				return false;
+		}
+
+		return true;
+	}
+};
+
+NFmiClassicFile::~NFmiClassicFile()
+{
+	if (itsData)
+	{
+		munmap(const_cast<unsigned char*>(itsData), itsSize);
+	}
+}
+
+unique_ptr<NFmiClassicFile> NFmiClassicFile::Open(const string& theFileName)
+{
+	const int fd = open(theFileName.c_str(), O_RDONLY);
+
+	if (fd < 0)
+	{
+		return nullptr;
+	}
+
+	struct stat st;
+	unique_ptr<NFmiClassicFile> file;
+
+	if (fstat(fd, &st) == 0 && st.st_size >= 4)
+	{
+		const auto size = static_cast<size_t>(st.st_size);
+		void* ptr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+		if (ptr != MAP_FAILED)
+		{
+			file.reset(new NFmiClassicFile());
+			file->itsData = static_cast<const unsigned char*>(ptr);
+			file->itsSize = size;
+
+			if (!file->ParseHeader())
+			{
+				file.reset();
+			}
+		}
+	}
+
+	close(fd);
+
+	return file;
+}
+
+bool NFmiClassicFile::ParseHeader()
+{
+	// CDF-1 and CDF-2 only; CDF-5 and hdf5 based files are left to netcdf library
+
+	if (memcmp(itsData, "CDF", 3) != 0 || (itsData[3] != 1 && itsData[3] != 2))
+	{
+		return false;
+	}
+
+	const bool offset64 = (itsData[3] == 2);
+
+	HeaderReader reader{itsData, itsSize, 4};
+
+	uint32_t numrecs, tag, nelems;
+
+	if (!reader.Get32(numrecs) || numrecs == CDF_STREAMING)
+	{
+		return false;
+	}
+
+	itsNumRecords = numrecs;
+
+	// dimensions; length zero is the record dimension
+
+	if (!reader.Get32(tag) || !reader.Get32(nelems) || (tag != CDF_DIMENSION && (tag != 0 || nelems != 0)) ||
+	    !reader.Fits(nelems))
+	{
+		return false;
+	}
+
+	vector<size_t> dims;
+	dims.reserve(nelems);
+
+	for (uint32_t i = 0; i < nelems; i++)
+	{
+		uint32_t len;
+
+		if (!reader.SkipName() || !reader.Get32(len))
+			return false;
+
+		dims.push_back(len);
+	}
+
+	if (!reader.SkipAttributes())
+	{
+		return false;
+	}
+
+	// variables
+
+	if (!reader.Get32(tag) || !reader.Get32(nelems) || (tag != CDF_VARIABLE && (tag != 0 || nelems != 0)) ||
+	    !reader.Fits(nelems))
+	{
+		return false;
+	}
+
+	itsVariables.reserve(nelems);
+
+	size_t numRecordVars = 0;
+	size_t recordSize = 0;
+
+	for (uint32_t i = 0; i < nelems; i++)
+	{
+		uint32_t ndims, type, vsize;
+
+		if (!reader.SkipName() || !reader.Get32(ndims) || ndims > dims.size())
+			return false;
+
+		Variable var;
+		var.record = false;
+		var.shape.reserve(ndims);
+
+		for (uint32_t j = 0; j < ndims; j++)
+		{
+			uint32_t dimid;
+
+			if (!reader.Get32(dimid) || dimid >= dims.size())
+				return false;
+
+			if (dims[dimid] == 0)
+			{
+				// only the first dimension can be the record dimension
+				if (j != 0)
+					return false;
+
+				var.record = true;
+			}
+
+			var.shape.push_back(dims[dimid]);
+		}
+
+		if (!reader.SkipAttributes() || !reader.Get32(type) || !reader.Get32(vsize))
+			return false;
+
+		var.type = static_cast<int>(type);
+		var.typeSize = TypeSize(type);
+
+		if (var.typeSize == 0)
+			return false;
+
+		if (offset64)
+		{
+			if (!reader.Get64(var.begin))
+				return false;
+		}
+		else
+		{
+			uint32_t begin;
+
+			if (!reader.Get32(begin))
+				return false;
+
+			var.begin = begin;
+		}
+
+		if (var.record)
+		{
+			// vsize does not fit large variables, compute size of one record
+
+			size_t n = var.typeSize;
+
+			for (size_t j = 1; j < var.shape.size(); j++)
+				n *= var.shape[j];
+
+			numRecordVars++;
+			recordSize += Padded(n);
+
+			// record size has no padding if there is only one record variable
+			if (numRecordVars == 1)
+				itsRecordSize = n;
+		}
+
+		itsVariables.push_back(std::move(var));
+	}
+
+	if (numRecordVars > 1)
+	{
+		itsRecordSize = recordSize;
+	}
+
+	for (auto& var : itsVariables)
+	{
+		if (var.record)
+			var.shape[0] = itsNumRecords;
+	}
+
+	return true;
+}
+
+template <typename T>
+bool NFmiClassicFile::Read(int varid, const size_t* start, const size_t* count, T* values,
+                           const DecodeParams& params) const
+{
+	if (varid < 0 || static_cast<size_t>(varid) >= itsVariables.size())
+	{
+		return false;
+	}
+
+	const Variable& var = itsVariables[static_cast<size_t>(varid)];
+
+	if (var.type == NC_CHAR)
+	{
+		return false;
+	}
+
+	const int ndims = static_cast<int>(var.shape.size());
+
+	for (int i = 0; i < ndims; i++)
+	{
+		if (start[i] + count[i] > var.shape[i])
+			return false;
+
+		if (count[i] == 0)
+			return true;
+	}
+
+	// Element strides; record variables have the record dimension stride
+	// separately in itsRecordSize
+
+	size_t stride[NC_MAX_VAR_DIMS];
+	size_t s = 1;
+
+	if (ndims > NC_MAX_VAR_DIMS)
+	{
+		return false;
+	}
+
+	for (int i = ndims - 1; i >= 0; i--)
+	{
+		stride[i] = s;
+		s *= var.shape[i];
+	}
+
+	// Innermost dimensions that are read whole, and the first partially read
+	// dimension, are contiguous in the file. Dimensions 0..d are iterated.
+	// Record dimension is never contiguous.
+
+	const int first = var.record ? 1 : 0;
+
+	size_t run = 1;
+	int d = ndims - 1;
+
+	while (d >= first)
+	{
+		run *= count[d];
+		d--;
+
+		if (count[d + 1] != var.shape[d + 1])
+			break;
+	}
+
+	size_t index[NC_MAX_VAR_DIMS] = {0};
+	size_t inner = 0;
+
+	for (int i = d + 1; i < ndims; i++)
+	{
+		inner += start[i] * stride[i];
+	}
+
+	const size_t runBytes = run * var.typeSize;
+
+	for (;;)
+	{
+		uint64_t offset = var.begin;
+		size_t element = inner;
+
+		for (int i = 0; i <= d; i++)
+		{
+			if (var.record && i == 0)
+				offset += (start[0] + index[0]) * itsRecordSize;
+			else
+				element += (start[i] + index[i]) * stride[i];
+		}
+
+		offset += element * var.typeSize;
+
+		if (offset > itsSize || runBytes > itsSize - offset)
+		{
+			return false;
+		}
+
+		if (!Decode(itsData + offset, var.type, run, values, params))
+		{
+			return false;
+		}
+
+		values += run;
+
+		// advance to next run
+
+		int i = d;
+
+		while (i >= 0 && ++index[i] == count[i])
+		{
+			index[i] = 0;
+			i--;
+		}
+
+		if (i < 0)
+		{
+			return true;
+		}
+	}
+}
+
+template bool NFmiClassicFile::Read(int, const size_t*, const size_t*, float*, const DecodeParams&) const;
+template bool NFmiClassicFile::Read(int, const size_t*, const size_t*, double*, const DecodeParams&) const;
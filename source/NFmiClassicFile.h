@@ -0,0 +1,67 @@
+/*
+ * class NFmiClassicFile
+ *
+ * Read-only memory mapped access to netcdf classic (CDF-1) and 64-bit
+ * offset (CDF-2) format files. The header is parsed directly from the
+ * mapping and variable data is converted from its big-endian external
+ * representation without going through the netcdf library.
+ *
+ * Internal to fminc; NFmiNetCDF uses this for data reads when possible
+ * and falls back to the netcdf library otherwise.
+ */
+
+#ifndef NFMICLASSICFILE_H
+#define NFMICLASSICFILE_H
+
+#include "NFmiDecode.h"
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+class NFmiClassicFile
+{
+   public:
+	~NFmiClassicFile();
+
+	NFmiClassicFile(const NFmiClassicFile&) = delete;
+	NFmiClassicFile& operator=(const NFmiClassicFile&) = delete;
+
+	// Map file and parse its header. Returns nullptr if file is not in
+	// classic or 64-bit offset format, or header could not be parsed.
+
+	static std::unique_ptr<NFmiClassicFile> Open(const std::string& theFileName);
+
+	// Read a hyperslab of variable 'varid' (same id as in netcdf library)
+	// converted to T, optionally unpacked as given by 'params'. Returns false
+	// if variable is not numeric, hyperslab is not inside the file or a value
+	// does not fit to T.
+
+	template <typename T>
+	bool Read(int varid, const size_t* start, const size_t* count, T* values,
+	          const DecodeParams& params = DecodeParams()) const;
+
+   private:
+	struct Variable
+	{
+		int type;
+		size_t typeSize;
+		bool record;
+		std::vector<size_t> shape;
+		uint64_t begin;
+	};
+
+	NFmiClassicFile() = default;
+
+	bool ParseHeader();
+
+	const unsigned char* itsData = nullptr;
+	size_t itsSize = 0;
+
+	size_t itsNumRecords = 0;
+	size_t itsRecordSize = 0;
+
+	std::vector<Variable> itsVariables;
+};
+
+#endif /* NFMICLASSICFILE_H */
@@ -0,0 +1,479 @@
+#include "NFmiDecode.h"
+#include <cfloat>
+#include <cmath>
+#include <cstdlib>
+#include <limits>
+#include <netcdf.h>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FMINC_DECODE_X86
+#endif
+
+using namespace std;
+
+// Fill value i as stored type U. Returns false if there is no such fill value
+// or it cannot be represented in U, in which case no stored value can match it.
+
+template <typename U>
+bool StoredFill(const DecodeParams& p, int i, U& fill)
+{
+	if (i >= p.fillCount)
+	{
+		return false;
+	}
+
+	const double value = p.fill[i];
+
+	if constexpr (!is_floating_point<U>::value)
+	{
+		// max + 1 is exact also for 64-bit types, where max itself rounds up
+
+		if (!(value >= static_cast<double>(numeric_limits<U>::min()) &&
+		      value < static_cast<double>(numeric_limits<U>::max()) + 1 && value == std::trunc(value)))
+		{
+			return false;
+		}
+	}
+
+	fill = static_cast<U>(value);
+	return true;
+}
+
+// Both fill values as stored type; if only one is usable it is returned twice.
+// Returns false if neither is.
+
+template <typename U>
+bool StoredFills(const DecodeParams& p, U& fill0, U& fill1)
+{
+	const bool has0 = StoredFill(p, 0, fill0);
+	const bool has1 = StoredFill(p, 1, fill1);
+
+	if (has0 && !has1)
+	{
+		fill1 = fill0;
+	}
+	else if (!has0 && has1)
+	{
+		fill0 = fill1;
+	}
+
+	return has0 || has1;
+}
+
+template <typename U>
+inline bool IsFill(U value, U fill)
+{
+	// NaN fill value matches all NaNs
+	return value == fill || (fill != fill && value != value);
+}
+
+template <typename U>
+inline U LoadNative(const unsigned char* src)
+{
+	U value;
+	memcpy(&value, src, sizeof(U));
+	return value;
+}
+
+// Reference implementation, also used for the tails of vectorized kernels.
+// Vectorized kernels must produce identical results, checked by
+// bench/fminc_decode ('make decode-check').
+
+template <typename T, typename U, bool BigEndian = true>
+bool DecodeScalar(const unsigned char* src, size_t n, T* dst, const DecodeParams& p)
+{
+	U fill0 = U(), fill1 = U();
+	const bool hasFill = StoredFills(p, fill0, fill1);
+	const bool scaled = (p.scale != 1 || p.offset != 0);
+	const T scale = static_cast<T>(p.scale);
+	const T offset = static_cast<T>(p.offset);
+	const T missing = static_cast<T>(p.missing);
+
+	bool inRange = true;
+
+	for (size_t i = 0; i < n; i++)
+	{
+		const U raw = BigEndian ? LoadBigEndian<U>(src + i * sizeof(U)) : LoadNative<U>(src + i * sizeof(U));
+
+		if (hasFill && (IsFill(raw, fill0) || IsFill(raw, fill1)))
+		{
+			dst[i] = missing;
+			continue;
+		}
+
+		if constexpr (sizeof(T) < sizeof(U) && is_floating_point<U>::value)
+		{
+			if (std::isfinite(raw) && std::fabs(raw) > FLT_MAX)
+			{
+				inRange = false;
+				dst[i] = missing;
+				continue;
+			}
+		}
+
+		T value = static_cast<T>(raw);
+
+		if (scaled)
+		{
+			value = value * scale + offset;
+		}
+
+		dst[i] = value;
+	}
+
+	return inRange;
+}
+
+// Vectorized kernels for float output. Stored values are swapped and widened
+// to 32-bit lanes, fill is compared in the stored type and arithmetic is done
+// in float, same as in DecodeScalar<float, U>.
+
+typedef void (*FloatKernel)(const unsigned char* src, size_t n, float* dst, const DecodeParams& p);
+
+struct FloatKernels
+{
+	const char* name;
+	FloatKernel fromShort;
+	FloatKernel fromInt;
+	FloatKernel fromFloat;
+};
+
+void ScalarShort(const unsigned char* src, size_t n, float* dst, const DecodeParams& p)
+{
+	DecodeScalar<float, int16_t>(src, n, dst, p);
+}
+
+void ScalarInt(const unsigned char* src, size_t n, float* dst, const DecodeParams& p)
+{
+	DecodeScalar<float, int32_t>(src, n, dst, p);
+}
+
+void ScalarFloat(const unsigned char* src, size_t n, float* dst, const DecodeParams& p)
+{
+	DecodeScalar<float, float>(src, n, dst, p);
+}
+
+#ifdef FMINC_DECODE_X86
+
+// AVX2: eight lanes
+
+__attribute__((target("avx2"))) inline __m256 FillMaskAVX2(__m256i v, int32_t fill0, int32_t fill1)
+{
+	return _mm256_castsi256_ps(_mm256_or_si256(_mm256_cmpeq_epi32(v, _mm256_set1_epi32(fill0)),
+	                                           _mm256_cmpeq_epi32(v, _mm256_set1_epi32(fill1))));
+}
+
+__attribute__((target("avx2"))) inline __m256 FillMaskAVX2(__m256 v, float fill)
+{
+	return (fill != fill) ? _mm256_cmp_ps(v, v, _CMP_UNORD_Q) : _mm256_cmp_ps(v, _mm256_set1_ps(fill), _CMP_EQ_OQ);
+}
+
+__attribute__((target("avx2"))) inline void FinishAVX2(__m256 v, __m256 fillMask, bool scaled, __m256 scale,
+                                                       __m256 offset, __m256 missing, float* dst)
+{
+	if (scaled)
+	{
+		v = _mm256_add_ps(_mm256_mul_ps(v, scale), offset);
+	}
+
+	_mm256_storeu_ps(dst, _mm256_blendv_ps(v, missing, fillMask));
+}
+
+template <typename U>
+__attribute__((target("avx2"))) void DecodeAVX2(const unsigned char* src, size_t n, float* dst,
+                                                const DecodeParams& p)
+{
+	U fill0 = U(), fill1 = U();
+	const bool hasFill = StoredFills(p, fill0, fill1);
+	const bool scaled = (p.scale != 1 || p.offset != 0);
+	const __m256 scale = _mm256_set1_ps(static_cast<float>(p.scale));
+	const __m256 offset = _mm256_set1_ps(static_cast<float>(p.offset));
+	const __m256 missing = _mm256_set1_ps(static_cast<float>(p.missing));
+	const __m256 none = _mm256_setzero_ps();
+
+	size_t i = 0;
+
+	if constexpr (sizeof(U) == 2)
+	{
+		const __m256i swap = _mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14, 1, 0, 3, 2, 5, 4,
+		                                      7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+
+		for (; i + 16 <= n; i += 16)
+		{
+			const __m256i raw = _mm256_shuffle_epi8(
+			    _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + 2 * i)), swap);
+			const __m256i lo = _mm256_cvtepi16_epi32(_mm256_castsi256_si128(raw));
+			const __m256i hi = _mm256_cvtepi16_epi32(_mm256_extracti128_si256(raw, 1));
+
+			FinishAVX2(_mm256_cvtepi32_ps(lo), hasFill ? FillMaskAVX2(lo, fill0, fill1) : none, scaled, scale, offset,
+			           missing, dst + i);
+			FinishAVX2(_mm256_cvtepi32_ps(hi), hasFill ? FillMaskAVX2(hi, fill0, fill1) : none, scaled, scale, offset,
+			           missing, dst + i + 8);
+		}
+	}
+	else
+	{
+		const __m256i swap = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12, 3, 2, 1, 0, 7, 6,
+		                                      5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+
+		for (; i + 8 <= n; i += 8)
+		{
+			const __m256i raw = _mm256_shuffle_epi8(
+			    _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + 4 * i)), swap);
+
+			if constexpr (is_floating_point<U>::value)
+			{
+				const __m256 v = _mm256_castsi256_ps(raw);
+				const __m256 mask =
+				    hasFill ? _mm256_or_ps(FillMaskAVX2(v, fill0), FillMaskAVX2(v, fill1)) : none;
+
+				FinishAVX2(v, mask, scaled, scale, offset, missing, dst + i);
+			}
+			else
+			{
+				FinishAVX2(_mm256_cvtepi32_ps(raw), hasFill ? FillMaskAVX2(raw, fill0, fill1) : none, scaled, scale,
+				           offset, missing, dst + i);
+			}
+		}
+	}
+
+	DecodeScalar<float, U>(src + i * sizeof(U), n - i, dst + i, p);
+}
+
+// SSE4.1: four lanes
+
+__attribute__((target("sse4.1"))) inline __m128 FillMaskSSE(__m128i v, int32_t fill0, int32_t fill1)
+{
+	return _mm_castsi128_ps(
+	    _mm_or_si128(_mm_cmpeq_epi32(v, _mm_set1_epi32(fill0)), _mm_cmpeq_epi32(v, _mm_set1_epi32(fill1))));
+}
+
+__attribute__((target("sse4.1"))) inline __m128 FillMaskSSE(__m128 v, float fill)
+{
+	return (fill != fill) ? _mm_cmpunord_ps(v, v) : _mm_cmpeq_ps(v, _mm_set1_ps(fill));
+}
+
+__attribute__((target("sse4.1"))) inline void FinishSSE(__m128 v, __m128 fillMask, bool scaled, __m128 scale,
+                                                        __m128 offset, __m128 missing, float* dst)
+{
+	if (scaled)
+	{
+		v = _mm_add_ps(_mm_mul_ps(v, scale), offset);
+	}
+
+	_mm_storeu_ps(dst, _mm_blendv_ps(v, missing, fillMask));
+}
+
+template <typename U>
+__attribute__((target("sse4.1"))) void DecodeSSE(const unsigned char* src, size_t n, float* dst,
+                                                 const DecodeParams& p)
+{
+	U fill0 = U(), fill1 = U();
+	const bool hasFill = StoredFills(p, fill0, fill1);
+	const bool scaled = (p.scale != 1 || p.offset != 0);
+	const __m128 scale = _mm_set1_ps(static_cast<float>(p.scale));
+	const __m128 offset = _mm_set1_ps(static_cast<float>(p.offset));
+	const __m128 missing = _mm_set1_ps(static_cast<float>(p.missing));
+	const __m128 none = _mm_setzero_ps();
+
+	size_t i = 0;
+
+	if constexpr (sizeof(U) == 2)
+	{
+		const __m128i swap = _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+
+		for (; i + 8 <= n; i += 8)
+		{
+			const __m128i raw =
+			    _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 2 * i)), swap);
+			const __m128i lo = _mm_cvtepi16_epi32(raw);
+			const __m128i hi = _mm_cvtepi16_epi32(_mm_srli_si128(raw, 8));
+
+			FinishSSE(_mm_cvtepi32_ps(lo), hasFill ? FillMaskSSE(lo, fill0, fill1) : none, scaled, scale, offset,
+			          missing, dst + i);
+			FinishSSE(_mm_cvtepi32_ps(hi), hasFill ? FillMaskSSE(hi, fill0, fill1) : none, scaled, scale, offset,
+			          missing, dst + i + 4);
+		}
+	}
+	else
+	{
+		const __m128i swap = _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+
+		for (; i + 4 <= n; i += 4)
+		{
+			const __m128i raw =
+			    _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 4 * i)), swap);
+
+			if constexpr (is_floating_point<U>::value)
+			{
+				const __m128 v = _mm_castsi128_ps(raw);
+				const __m128 mask = hasFill ? _mm_or_ps(FillMaskSSE(v, fill0), FillMaskSSE(v, fill1)) : none;
+
+				FinishSSE(v, mask, scaled, scale, offset, missing, dst + i);
+			}
+			else
+			{
+				FinishSSE(_mm_cvtepi32_ps(raw), hasFill ? FillMaskSSE(raw, fill0, fill1) : none, scaled, scale, offset,
+				          missing, dst + i);
+			}
+		}
+	}
+
+	DecodeScalar<float, U>(src + i * sizeof(U), n - i, dst + i, p);
+}
+
+#endif /* FMINC_DECODE_X86 */
+
+// Kernel sets this CPU can run, best first; scalar is always the last one
+
+const vector<FloatKernels>& KernelSets()
+{
+	static const vector<FloatKernels> sets = []()
+	{
+		vector<FloatKernels> ret;
+
+#ifdef FMINC_DECODE_X86
+		if (__builtin_cpu_supports("avx2"))
+		{
+			ret.push_back(FloatKernels{"avx2", DecodeAVX2<int16_t>, DecodeAVX2<int32_t>, DecodeAVX2<float>});
+		}
+
+		if (__builtin_cpu_supports("sse4.1"))
+		{
+			ret.push_back(FloatKernels{"sse4.1", DecodeSSE<int16_t>, DecodeSSE<int32_t>, DecodeSSE<float>});
+		}
+#endif
+
+		ret.push_back(FloatKernels{"scalar", ScalarShort, ScalarInt, ScalarFloat});
+
+		return ret;
+	}();
+
+	return sets;
+}
+
+const FloatKernels& SelectKernels()
+{
+	static const FloatKernels& kernels =
+	    (getenv("FMINC_DISABLE_SIMD") != nullptr && getenv("FMINC_DISABLE_SIMD")[0] == '1') ? KernelSets().back()
+	                                                                                          : KernelSets().front();
+
+	return kernels;
+}
+
+const char* DecodeKernel()
+{
+	return SelectKernels().name;
+}
+
+vector<string> DecodeKernels()
+{
+	vector<string> names;
+
+	for (const auto& kernels : KernelSets())
+	{
+		names.push_back(kernels.name);
+	}
+
+	return names;
+}
+
+bool DecodeFloat(const FloatKernels& kernels, const unsigned char* src, int type, size_t n, float* dst,
+                 const DecodeParams& params)
+{
+	switch (type)
+	{
+		case NC_BYTE:
+			return DecodeScalar<float, signed char>(src, n, dst, params);
+		case NC_SHORT:
+			kernels.fromShort(src, n, dst, params);
+			return true;
+		case NC_INT:
+			kernels.fromInt(src, n, dst, params);
+			return true;
+		case NC_FLOAT:
+			kernels.fromFloat(src, n, dst, params);
+			return true;
+		case NC_DOUBLE:
+			return DecodeScalar<float, double>(src, n, dst, params);
+		default:
+			return false;
+	}
+}
+
+bool DecodeWith(const string& kernel, const unsigned char* src, int type, size_t n, float* dst,
+                const DecodeParams& params)
+{
+	for (const auto& kernels : KernelSets())
+	{
+		if (kernel == kernels.name)
+		{
+			return DecodeFloat(kernels, src, type, n, dst, params);
+		}
+	}
+
+	return false;
+}
+
+template <>
+bool Decode<float>(const unsigned char* src, int type, size_t n, float* dst, const DecodeParams& params)
+{
+	return DecodeFloat(SelectKernels(), src, type, n, dst, params);
+}
+
+template <>
+bool Decode<double>(const unsigned char* src, int type, size_t n, double* dst, const DecodeParams& params)
+{
+	switch (type)
+	{
+		case NC_BYTE:
+			return DecodeScalar<double, signed char>(src, n, dst, params);
+		case NC_SHORT:
+			return DecodeScalar<double, int16_t>(src, n, dst, params);
+		case NC_INT:
+			return DecodeScalar<double, int32_t>(src, n, dst, params);
+		case NC_FLOAT:
+			return DecodeScalar<double, float>(src, n, dst, params);
+		case NC_DOUBLE:
+			return DecodeScalar<double, double>(src, n, dst, params);
+		default:
+			return false;
+	}
+}
+
+template <typename T>
+bool DecodeNative(const unsigned char* src, int type, size_t n, T* dst, const DecodeParams& params)
+{
+	switch (type)
+	{
+		case NC_BYTE:
+			return DecodeScalar<T, signed char, false>(src, n, dst, params);
+		case NC_UBYTE:
+			return DecodeScalar<T, unsigned char, false>(src, n, dst, params);
+		case NC_SHORT:
+			return DecodeScalar<T, int16_t, false>(src, n, dst, params);
+		case NC_USHORT:
+			return DecodeScalar<T, uint16_t, false>(src, n, dst, params);
+		case NC_INT:
+			return DecodeScalar<T, int32_t, false>(src, n, dst, params);
+		case NC_UINT:
+			return DecodeScalar<T, uint32_t, false>(src, n, dst, params);
+		case NC_INT64:
+			return DecodeScalar<T, int64_t, false>(src, n, dst, params);
+		case NC_UINT64:
+			return DecodeScalar<T, uint64_t, false>(src, n, dst, params);
+		case NC_FLOAT:
+			return DecodeScalar<T, float, false>(src, n, dst, params);
+		case NC_DOUBLE:
+			return DecodeScalar<T, double, false>(src, n, dst, params);
+		default:
+			return false;
+	}
+}
+
+template bool DecodeNative<float>(const unsigned char*, int, size_t, float*, const DecodeParams&);
+template bool DecodeNative<double>(const unsigned char*, int, size_t, double*, const DecodeParams&);
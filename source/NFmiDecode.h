@@ -0,0 +1,96 @@
+/*
+ * Decoding of big-endian netcdf data to native float or double
+ *
+ * Byteswap, conversion to the output type, scale_factor/add_offset and
+ * mapping of fill value to a missing value are done in a single pass.
+ * Vectorized kernels (AVX2, SSE4.1) are selected at runtime; other
+ * architectures use the scalar code. bench/fminc_decode checks the kernels
+ * against the scalar code.
+ *
+ * Internal to fminc.
+ */
+
+#ifndef NFMIDECODE_H
+#define NFMIDECODE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+struct DecodeParams
+{
+	// value = stored * scale + offset, computed in the output type
+	double scale = 1;
+	double offset = 0;
+
+	// stored values equal to one of the fill values (_FillValue and
+	// missing_value) are replaced with missing
+	int fillCount = 0;
+	double fill[2] = {0, 0};
+	double missing = 0;
+};
+
+template <typename U>
+inline U LoadBigEndian(const unsigned char* src)
+{
+	U value;
+	memcpy(&value, src, sizeof(U));
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	if constexpr (sizeof(U) == 2)
+	{
+		uint16_t bits;
+		memcpy(&bits, &value, 2);
+		bits = __builtin_bswap16(bits);
+		memcpy(&value, &bits, 2);
+	}
+	else if constexpr (sizeof(U) == 4)
+	{
+		uint32_t bits;
+		memcpy(&bits, &value, 4);
+		bits = __builtin_bswap32(bits);
+		memcpy(&value, &bits, 4);
+	}
+	else if constexpr (sizeof(U) == 8)
+	{
+		uint64_t bits;
+		memcpy(&bits, &value, 8);
+		bits = __builtin_bswap64(bits);
+		memcpy(&value, &bits, 8);
+	}
+#endif
+
+	return value;
+}
+
+// Decode n values of netcdf type 'type' (NC_BYTE, NC_SHORT, NC_INT, NC_FLOAT
+// or NC_DOUBLE) from src to dst. Returns false if type is not supported or
+// a value does not fit to T; netcdf library reports a range error for those.
+
+template <typename T>
+bool Decode(const unsigned char* src, int type, size_t n, T* dst, const DecodeParams& params);
+
+// Same as Decode() for values in native byte order, as nc_get_vara() reads
+// them; also the netcdf4 unsigned and 64-bit integer types are supported. Used
+// for reads through the library, so that fill values are compared in the
+// stored type on both read paths.
+
+template <typename T>
+bool DecodeNative(const unsigned char* src, int type, size_t n, T* dst, const DecodeParams& params);
+
+// Name of the kernel set in use: "avx2", "sse4.1" or "scalar".
+// FMINC_DISABLE_SIMD=1 in environment forces scalar code.
+
+const char* DecodeKernel();
+
+// Names of the kernel sets this CPU can run, best first, "scalar" last.
+// DecodeWith() decodes to float with the given set instead of the one in use;
+// it returns false also if the set is not available.
+
+std::vector<std::string> DecodeKernels();
+bool DecodeWith(const std::string& kernel, const unsigned char* src, int type, size_t n, float* dst,
+                const DecodeParams& params);
+
+#endif /* NFMIDECODE_H */
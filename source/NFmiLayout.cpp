@@ -0,0 +1,104 @@
+#include "NFmiLayout.h"
+#include <algorithm>
+#include <vector>
+
+using namespace std;
+
+// Block edge in elements: a block of doubles (32 x 32 x 8 = 8 kB) and its
+// transposed counterpart fit comfortably in L1 cache
+
+const size_t BLOCK_SIZE = 32;
+
+template <typename T>
+void FlipSlice(T* data, size_t rows, size_t cols, bool flipX, bool flipY)
+{
+	if (flipX && flipY)
+	{
+		// both: the whole slice in reverse order
+		std::reverse(data, data + rows * cols);
+	}
+	else if (flipX)
+	{
+		for (size_t i = 0; i < rows; i++)
+		{
+			std::reverse(data + i * cols, data + (i + 1) * cols);
+		}
+	}
+	else if (flipY)
+	{
+		for (size_t i = 0; i < rows / 2; i++)
+		{
+			std::swap_ranges(data + i * cols, data + (i + 1) * cols, data + (rows - 1 - i) * cols);
+		}
+	}
+}
+
+template <typename T>
+void TransposeSquare(T* data, size_t n)
+{
+	// blocks above the diagonal are swapped with the transposed block below it,
+	// diagonal blocks are transposed within themselves
+
+	for (size_t bi = 0; bi < n; bi += BLOCK_SIZE)
+	{
+		const size_t iend = std::min(bi + BLOCK_SIZE, n);
+
+		for (size_t bj = bi; bj < n; bj += BLOCK_SIZE)
+		{
+			const size_t jend = std::min(bj + BLOCK_SIZE, n);
+
+			for (size_t i = bi; i < iend; i++)
+			{
+				for (size_t j = (bi == bj) ? i + 1 : bj; j < jend; j++)
+				{
+					std::swap(data[i * n + j], data[j * n + i]);
+				}
+			}
+		}
+	}
+}
+
+template <typename T>
+void TransposeSlice(T* data, size_t rows, size_t cols, vector<T>& scratch)
+{
+	if (rows <= 1 || cols <= 1)
+	{
+		// layout in memory does not change
+		return;
+	}
+
+	if (rows == cols)
+	{
+		TransposeSquare(data, rows);
+		return;
+	}
+
+	const size_t n = rows * cols;
+
+	scratch.assign(data, data + n);
+
+	const T* src = scratch.data();
+
+	for (size_t bi = 0; bi < rows; bi += BLOCK_SIZE)
+	{
+		const size_t iend = std::min(bi + BLOCK_SIZE, rows);
+
+		for (size_t bj = 0; bj < cols; bj += BLOCK_SIZE)
+		{
+			const size_t jend = std::min(bj + BLOCK_SIZE, cols);
+
+			for (size_t i = bi; i < iend; i++)
+			{
+				for (size_t j = bj; j < jend; j++)
+				{
+					data[j * rows + i] = src[i * cols + j];
+				}
+			}
+		}
+	}
+}
+
+template void FlipSlice(float*, size_t, size_t, bool, bool);
+template void FlipSlice(double*, size_t, size_t, bool, bool);
+template void TransposeSlice(float*, size_t, size_t, vector<float>&);
+template void TransposeSlice(double*, size_t, size_t, vector<double>&);
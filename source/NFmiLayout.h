@@ -0,0 +1,27 @@
+/*
+ * In-place layout changes of 2D slices: flips and transpose
+ *
+ * Internal to fminc.
+ */
+
+#ifndef NFMILAYOUT_H
+#define NFMILAYOUT_H
+
+#include <cstddef>
+#include <vector>
+
+// Flip a row-major rows x cols slice: flipX reverses the values of each row,
+// flipY reverses the order of rows
+
+template <typename T>
+void FlipSlice(T* data, size_t rows, size_t cols, bool flipX, bool flipY);
+
+// Transpose a row-major rows x cols slice to cols x rows. Done in cache
+// sized blocks; slices that are not square are copied to scratch first.
+// Scratch is owned by the caller, so it lives only as long as the read that
+// needs it, and consecutive slices of one read can share it.
+
+template <typename T>
+void TransposeSlice(T* data, size_t rows, size_t cols, std::vector<T>& scratch);
+
+#endif /* NFMILAYOUT_H */
@@ -0,0 +1,303 @@
+#include "NFmiMetadata.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <fmt/format.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+
+using namespace std;
+
+// Format of the sidecar: magic, version, then fields of NFmiMetadata in
+// declaration order in native byte order. Version is increased whenever the
+// layout or the meaning of cached data changes.
+
+const char METADATA_MAGIC[8] = {'F', 'M', 'I', 'N', 'C', 'M', 'D', '\0'};
+const uint32_t METADATA_VERSION = 2;
+
+// Bits of the lazily read parts in the sidecar
+
+const uint8_t METADATA_VALIDATED = 1;
+const uint8_t METADATA_X_RESOLUTION = 2;
+const uint8_t METADATA_Y_RESOLUTION = 4;
+
+// Appends values to a byte buffer
+
+struct MetadataWriter
+{
+	string buffer;
+
+	template <typename T>
+	void Put(const T& value)
+	{
+		buffer.append(reinterpret_cast<const char*>(&value), sizeof(T));
+	}
+
+	void Put(const string& value)
+	{
+		Put(static_cast<uint64_t>(value.size()));
+		buffer.append(value);
+	}
+
+	template <typename T>
+	void Put(const vector<T>& values)
+	{
+		Put(static_cast<uint64_t>(values.size()));
+
+		if (!values.empty())
+			buffer.append(reinterpret_cast<const char*>(values.data()), values.size() * sizeof(T));
+	}
+};
+
+// Bounds checked reader of a byte buffer
+
+struct MetadataReader
+{
+	const char* data;
+	size_t size;
+	size_t pos;
+
+	template <typename T>
+	bool Get(T& value)
+	{
+		if (sizeof(T) > size - pos)
+			return false;
+
+		memcpy(&value, data + pos, sizeof(T));
+		pos += sizeof(T);
+		return true;
+	}
+
+	bool Get(string& value)
+	{
+		uint64_t n;
+
+		if (!Get(n) || n > size - pos)
+			return false;
+
+		value.assign(data + pos, n);
+		pos += n;
+		return true;
+	}
+
+	template <typename T>
+	bool Get(vector<T>& values)
+	{
+		uint64_t n;
+
+		if (!Get(n) || n > (size - pos) / sizeof(T))
+			return false;
+
+		values.resize(n);
+
+		if (n > 0)
+			memcpy(values.data(), data + pos, n * sizeof(T));
+
+		pos += n * sizeof(T);
+		return true;
+	}
+};
+
+bool FileIdentity(const string& theFileName, string& thePath, uint64_t& theSize, int64_t& theMTime)
+{
+	struct stat st;
+
+	if (stat(theFileName.c_str(), &st) != 0)
+	{
+		return false;
+	}
+
+	char resolved[PATH_MAX];
+
+	if (!realpath(theFileName.c_str(), resolved))
+	{
+		return false;
+	}
+
+	thePath = resolved;
+	theSize = static_cast<uint64_t>(st.st_size);
+	theMTime = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+
+	return true;
+}
+
+string MetadataCacheFile(const string& theDirectory, const string& thePath)
+{
+	// FNV-1a of the path; collisions are detected when sidecar is read as the
+	// full path is stored in it
+
+	uint64_t hash = 14695981039346656037ULL;
+
+	for (unsigned char c : thePath)
+	{
+		hash = (hash ^ c) * 1099511628211ULL;
+	}
+
+	return fmt::format("{}/{:016x}.fminc", theDirectory, hash);
+}
+
+bool ReadMetadata(const string& theCacheFile, NFmiMetadata& md)
+{
+	const int fd = open(theCacheFile.c_str(), O_RDONLY);
+
+	if (fd == -1)
+	{
+		return false;
+	}
+
+	struct stat st;
+
+	if (fstat(fd, &st) != 0 || st.st_size <= 0)
+	{
+		close(fd);
+		return false;
+	}
+
+	string buffer(static_cast<size_t>(st.st_size), '\0');
+	const ssize_t n = read(fd, &buffer[0], buffer.size());
+
+	close(fd);
+
+	if (n != static_cast<ssize_t>(buffer.size()))
+	{
+		return false;
+	}
+
+	MetadataReader r{buffer.data(), buffer.size(), 0};
+
+	char magic[sizeof(METADATA_MAGIC)];
+	uint32_t version;
+
+	if (!r.Get(magic) || memcmp(magic, METADATA_MAGIC, sizeof(magic)) != 0 || !r.Get(version) ||
+	    version != METADATA_VERSION)
+	{
+		return false;
+	}
+
+	if (!(r.Get(md.path) && r.Get(md.size) && r.Get(md.mtime) && r.Get(md.numDims) && r.Get(md.numVars) &&
+	      r.Get(md.xDim) && r.Get(md.yDim) && r.Get(md.tDim) && r.Get(md.zDim) && r.Get(md.mDim) && r.Get(md.xVar) &&
+	      r.Get(md.yVar) && r.Get(md.tVar) && r.Get(md.zVar) && r.Get(md.mVar) && r.Get(md.projectionVar) &&
+	      r.Get(md.convention) && r.Get(md.projection) && r.Get(md.parameters)))
+	{
+		return false;
+	}
+
+	uint64_t numVars;
+
+	if (!r.Get(numVars) || numVars != static_cast<uint64_t>(md.numVars))
+	{
+		return false;
+	}
+
+	md.attributes.assign(numVars, {});
+
+	for (auto& atts : md.attributes)
+	{
+		uint64_t numAtts;
+
+		if (!r.Get(numAtts))
+		{
+			return false;
+		}
+
+		for (uint64_t i = 0; i < numAtts; i++)
+		{
+			string name;
+			NFmiNetCDF::Attribute a;
+
+			if (!(r.Get(name) && r.Get(a.type) && r.Get(a.text) && r.Get(a.values)))
+			{
+				return false;
+			}
+
+			atts.emplace(std::move(name), std::move(a));
+		}
+	}
+
+	uint8_t flags;
+
+	if (!(r.Get(md.times) && r.Get(md.levels) && r.Get(flags) && r.Get(md.xResolutionDrift) &&
+	      r.Get(md.yResolutionDrift) && r.Get(md.xResolution) && r.Get(md.yResolution) && r.pos == r.size))
+	{
+		return false;
+	}
+
+	md.validated = (flags & METADATA_VALIDATED) != 0;
+	md.xResolutionCached = (flags & METADATA_X_RESOLUTION) != 0;
+	md.yResolutionCached = (flags & METADATA_Y_RESOLUTION) != 0;
+
+	return true;
+}
+
+bool WriteMetadata(const string& theCacheFile, const NFmiMetadata& md)
+{
+	MetadataWriter w;
+
+	w.Put(METADATA_MAGIC);
+	w.Put(METADATA_VERSION);
+
+	w.Put(md.path);
+	w.Put(md.size);
+	w.Put(md.mtime);
+	w.Put(md.numDims);
+	w.Put(md.numVars);
+
+	for (int id : {md.xDim, md.yDim, md.tDim, md.zDim, md.mDim, md.xVar, md.yVar, md.tVar, md.zVar, md.mVar,
+	               md.projectionVar})
+	{
+		w.Put(id);
+	}
+
+	w.Put(md.convention);
+	w.Put(md.projection);
+	w.Put(md.parameters);
+
+	w.Put(static_cast<uint64_t>(md.attributes.size()));
+
+	for (const auto& atts : md.attributes)
+	{
+		w.Put(static_cast<uint64_t>(atts.size()));
+
+		for (const auto& att : atts)
+		{
+			w.Put(att.first);
+			w.Put(att.second.type);
+			w.Put(att.second.text);
+			w.Put(att.second.values);
+		}
+	}
+
+	w.Put(md.times);
+	w.Put(md.levels);
+
+	const int flags = (md.validated ? METADATA_VALIDATED : 0) | (md.xResolutionCached ? METADATA_X_RESOLUTION : 0) |
+	                  (md.yResolutionCached ? METADATA_Y_RESOLUTION : 0);
+
+	w.Put(static_cast<uint8_t>(flags));
+	w.Put(md.xResolutionDrift);
+	w.Put(md.yResolutionDrift);
+	w.Put(md.xResolution);
+	w.Put(md.yResolution);
+
+	const string tmpFile = fmt::format("{}.{}.{}", theCacheFile, getpid(), hash<thread::id>()(this_thread::get_id()));
+
+	FILE* fp = fopen(tmpFile.c_str(), "wb");
+
+	if (!fp)
+	{
+		return false;
+	}
+
+	const bool ok = (fwrite(w.buffer.data(), 1, w.buffer.size(), fp) == w.buffer.size());
+
+	if (fclose(fp) != 0 || !ok || rename(tmpFile.c_str(), theCacheFile.c_str()) != 0)
+	{
+		unlink(tmpFile.c_str());
+		return false;
+	}
+
+	return true;
+}
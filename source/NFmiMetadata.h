@@ -0,0 +1,75 @@
+/*
+ * Persistent cache of file metadata
+ *
+ * What NFmiNetCDF::Read() derives from a file (dimension and variable roles,
+ * parameter list, attributes, time and level axes, grid resolution) is stored
+ * in a small binary sidecar file. The sidecar is valid as long as the path,
+ * size and modification time of the data file are unchanged.
+ *
+ * Internal to fminc.
+ */
+
+#ifndef NFMIMETADATA_H
+#define NFMIMETADATA_H
+
+#include "NFmiNetCDF.h"
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+struct NFmiMetadata
+{
+	// identity of the data file
+	std::string path;
+	uint64_t size = 0;
+	int64_t mtime = 0;  // nanoseconds
+
+	int numDims = 0;
+	int numVars = 0;
+
+	// dimension and variable ids, -1 if not present
+	int xDim = -1, yDim = -1, tDim = -1, zDim = -1, mDim = -1;
+	int xVar = -1, yVar = -1, tVar = -1, zVar = -1, mVar = -1, projectionVar = -1;
+
+	std::string convention;
+	std::string projection;
+
+	std::vector<int> parameters;
+	std::vector<std::unordered_map<std::string, NFmiNetCDF::Attribute>> attributes;
+
+	// Lazily read parts: axes are empty and flags unset if they had not been
+	// read when the sidecar was written
+
+	std::vector<double> times;
+	std::vector<float> levels;
+
+	bool validated = false;
+	bool xResolutionCached = false;
+	bool yResolutionCached = false;
+
+	float xResolutionDrift = 0;
+	float yResolutionDrift = 0;
+	double xResolution = 0;
+	double yResolution = 0;
+};
+
+// Absolute path, size and modification time of a file; false if it can not be stat'ed
+
+bool FileIdentity(const std::string& theFileName, std::string& thePath, uint64_t& theSize, int64_t& theMTime);
+
+// Name of the sidecar of a data file in cache directory
+
+std::string MetadataCacheFile(const std::string& theDirectory, const std::string& thePath);
+
+// Sidecar is read with a single read call. Returns false if file does not
+// exist, is of another format version or is truncated.
+
+bool ReadMetadata(const std::string& theCacheFile, NFmiMetadata& theMetadata);
+
+// Write to a temporary file and rename, so that concurrent readers see
+// either the old or the new sidecar
+
+bool WriteMetadata(const std::string& theCacheFile, const NFmiMetadata& theMetadata);
+
+#endif /* NFMIMETADATA_H */
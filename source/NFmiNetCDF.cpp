@@ -1,111 +1,201 @@
 #include "NFmiNetCDF.h"
+#include "NFmiClassicFile.h"
+#include "NFmiDecode.h"
+#include "NFmiLayout.h"
+#include "NFmiMetadata.h"
+#include "NFmiPrecision.h"
+#include "NFmiSliceCache.h"
 #include <algorithm>
 #include <atomic>
 #include <boost/filesystem.hpp>
 #include <cmath>
+#include <cstring>
 #include <ctime>
 #include <fmt/format.h>
 #include <fstream>
+#include <functional>
 #include <iomanip>
+#include <limits>
+#include <mutex>
 #include <numeric>
 #include <sstream>
 #include <stdexcept>
+#include <thread>
 
 const float MAX_COORDINATE_RESOLUTION_ERROR = 1e-4f;
+const size_t DEFAULT_COPY_BUFFER_SIZE = 64 * 1024 * 1024;
+
+// Packed shorts use range [-32767, 32767], fill value is outside of it
+const short PACKED_FILL_VALUE = -32768;
+const double PACKED_RANGE = 65534;
+
+// Point extraction reads the bounding window of all points when it is at most
+// this many times larger than the grid cells the points need
+const size_t DENSE_POINT_FACTOR = 16;
 const float NFmiNetCDF::kFloatMissing = 32700.0f;
 
 static std::atomic<bool> xCoordinateWarning(true);
 static std::atomic<bool> yCoordinateWarning(true);
 
-const bool USE_IMPROVED_PRECISION =
-    getenv("FMINC_USE_IMPROVED_PRECISION") != nullptr && getenv("FMINC_USE_IMPROVED_PRECISION")[0] == '1';
+// netcdf library is not thread safe: all library calls are serialized with
+// this mutex, see NFmiNetCDF::LibraryMutex(). Reads of memory mapped classic
+// files do not call the library. Recursive, so that methods can take it for
+// their own calls also when caller or another method already holds it.
+
+static std::recursive_mutex netcdfMutex;
+
+// Classic format files are read from a memory mapping unless disabled
+
+const bool DISABLE_MMAP = getenv("FMINC_DISABLE_MMAP") != nullptr && getenv("FMINC_DISABLE_MMAP")[0] == '1';
 
 using namespace std;
 
-bool CopyAtts(NcVar* newvar, const NcVar* oldvar);
-bool CopyVar(NcVar** newvar, NcVar* oldvar, NcFile* theOutFile, long* dimension_position, long* dimension_length);
-vector<pair<string, string>> ReadGlobalAttributes(NcFile* theFile);
+bool CopyAtts(NcVar* newvar, const NcVar* oldvar, bool skipPacking = false);
+NcVar* DefineVar(NcVar* oldvar, NcFile* theOutFile, NcType theType = ncNoType);
 
-int NumberOfDecimalDigits(std::string str)
+// How CopyData() moves data: at most maxBytes are held in memory at a time,
+// and blocks are aligned to source chunks. Data is moved with the netcdf C api
+// between files ncid and outNcid; output file must be in data mode.
+
+struct CopyOptions
 {
-	// - remove all trailing zeros
-	// - count number of digits
-	str.erase(str.find_last_not_of('0') + 1, std::string::npos);
-	const auto dot = str.find('.');
-	size_t num_digits = (dot == std::string::npos) ? 0 : str.length() - dot - 1;
-	num_digits = std::min(num_digits, static_cast<size_t>(8));  // prevent neverending floats to inflate digitcount
-	return static_cast<int>(num_digits);
-}
+	size_t maxBytes = DEFAULT_COPY_BUFFER_SIZE;
+	int ncid = -1;
+	int outNcid = -1;
+};
 
-template <typename T, typename U>
-T ToPrecision(U val, int num_digits)
+bool CopyData(NcVar* newvar, NcVar* oldvar, long* dimension_position, long* dimension_length, long* output_position,
+              const CopyOptions& options);
+NcDim* FindDim(NcFile* theFile, const char* name);
+vector<pair<string, string>> ReadGlobalAttributes(NcFile* theFile);
+
+float ResolutionDrift(const vector<float>& tmp)
 {
-	if (USE_IMPROVED_PRECISION == false)
-	{
-		return static_cast<T>(val);
-	}
+	// Check resolution
 
-	std::string val_str = fmt::format("{:.{}f}", val, num_digits);
+	float resolution = 0;
+	float prevResolution = resolution;
 
-	if (std::is_same<T, float>::value)
-	{
-		return std::stof(val_str);
-	}
-	else if (std::is_same<T, double>::value)
+	float prevX = tmp[0];
+
+	for (unsigned int k = 1; k < tmp.size(); k++)
 	{
-		return std::stod(val_str);
+		resolution = tmp[k] - prevX;
+
+		if (tmp[k] == -1 || prevX == -1)
+		{
+			prevX = tmp[k];
+			continue;
+		}
+		if (k == 1)
+			prevResolution = resolution;
+
+		if (abs(resolution - prevResolution) > MAX_COORDINATE_RESOLUTION_ERROR)
+		{
+			return abs(resolution - prevResolution);
+		}
+
+		prevResolution = resolution;
+		prevX = tmp[k];
 	}
+
+	return 0.0f;
 }
-template <typename T, typename U>
-T ToSamePrecision(U val)
-{
-	// If casting from float to double, we might get
-	// some unwanted extra decimal digits.
-	// Make sure that after casting we have the same
-	// number of digits.
 
-	int num_digits = NumberOfDecimalDigits(std::to_string(val));
+// Typed reads through the netcdf C api; values are converted from the
+// external type of the variable by the library
+
+int GetVara(int ncid, int varid, const size_t* start, const size_t* count, float* values)
+{
+	return nc_get_vara_float(ncid, varid, start, count, values);
+}
 
-	return ToPrecision<T>(val, num_digits);
+int GetVara(int ncid, int varid, const size_t* start, const size_t* count, double* values)
+{
+	return nc_get_vara_double(ncid, varid, start, count, values);
 }
 
 template <typename T>
-vector<T> Values(const NcVar* var, long* lengths = 0)
+vector<T> Values(int ncid, const NcVar* var)
 {
-	bool allocated = false;
-	if (lengths == 0)
+	size_t start[NC_MAX_VAR_DIMS], count[NC_MAX_VAR_DIMS];
+	size_t N = 1;
+
+	for (int i = 0; i < var->num_dims(); i++)
 	{
-		allocated = true;
-		lengths = var->edges();
+		start[i] = 0;
+		count[i] = static_cast<size_t>(var->get_dim(i)->size());
+		N *= count[i];
 	}
 
-	const size_t N = std::accumulate(lengths, lengths + var->num_dims(), 1, [](long a, long b) { return a * b; });
-
 	vector<T> values(N, NFmiNetCDF::kFloatMissing);
 
 #ifdef DEBUG
-	NcBool ret =
+	int ret =
 #endif
-	    var->get(values.data(), lengths);
-
-	if (allocated)
-	{
-		delete[] lengths;
-	}
+	    GetVara(ncid, var->id(), start, count, values.data());
 
 #ifdef DEBUG
-	assert(ret);
+	assert(ret == NC_NOERR);
 #endif
 
 	return values;
 }
 
+// Read a single value from a (possibly multidimensional) variable using
+// a linear index, ie. the same index as NcVar::as_double() takes
+
+double ValueAt(int ncid, const NcVar* var, long index)
+{
+	size_t position[NC_MAX_VAR_DIMS];
+
+	for (int i = var->num_dims() - 1; i >= 0; i--)
+	{
+		const long len = var->get_dim(i)->size();
+		position[i] = static_cast<size_t>(index % len);
+		index /= len;
+	}
+
+	double value = NFmiNetCDF::kFloatMissing;
+	nc_get_var1_double(ncid, var->id(), position, &value);
+
+	return value;
+}
+
+// CF packing attributes of a variable: scale_factor, add_offset and fill values
+// from _FillValue and missing_value; fill values are mapped to kFloatMissing
+
+DecodeParams UnpackParams(const NFmiNetCDF& nc, const NcVar* var)
+{
+	DecodeParams params;
+	params.scale = nc.AttValue(var, "scale_factor", 1);
+	params.offset = nc.AttValue(var, "add_offset", 0);
+	params.missing = NFmiNetCDF::kFloatMissing;
+
+	for (const char* name : {"_FillValue", "missing_value"})
+	{
+		const NFmiNetCDF::Attribute* att = nc.GetAtt(var, name);
+
+		if (att && !att->values.empty())
+		{
+			params.fill[params.fillCount++] = att->values[0];
+		}
+	}
+
+	return params;
+}
+
 NFmiNetCDF::NFmiNetCDF()
     : itsTDim(0),
       itsXDim(0),
       itsYDim(0),
       itsZDim(0),
       itsMDim(0),
+      itsMetadataCache(getenv("FMINC_METADATA_CACHE") ? getenv("FMINC_METADATA_CACHE") : ""),
+      itsFileSize(0),
+      itsFileMTime(0),
+      itsSavedMetadata(-1),
+      itsSliceCache(nullptr),
       itsProjection("latitude_longitude"),
       itsZVar(0),
       itsXVar(0),
@@ -114,7 +204,21 @@ NFmiNetCDF::NFmiNetCDF()
       itsMVar(0),
       itsProjectionVar(0),
       itsXFlip(false),
-      itsYFlip(false)
+      itsYFlip(false),
+      itsForceRowMajor(false),
+      itsUnpack(false),
+      itsCopyBufferSize(DEFAULT_COPY_BUFFER_SIZE),
+      itsChunkCacheSize(0),
+      itsChunkCacheSlots(0),
+      itsChunkCachePreemption(0),
+      itsTimesSorted(false),
+      itsValidated(false),
+      itsXResolutionDrift(0),
+      itsYResolutionDrift(0),
+      itsXResolutionCached(false),
+      itsYResolutionCached(false),
+      itsXResolution(kFloatMissing),
+      itsYResolution(kFloatMissing)
 {
 }
 
@@ -124,6 +228,11 @@ NFmiNetCDF::NFmiNetCDF(const string& theInfile)
       itsYDim(0),
       itsZDim(0),
       itsMDim(0),
+      itsMetadataCache(getenv("FMINC_METADATA_CACHE") ? getenv("FMINC_METADATA_CACHE") : ""),
+      itsFileSize(0),
+      itsFileMTime(0),
+      itsSavedMetadata(-1),
+      itsSliceCache(nullptr),
       itsProjection("latitude_longitude"),
       itsZVar(0),
       itsXVar(0),
@@ -132,40 +241,109 @@ NFmiNetCDF::NFmiNetCDF(const string& theInfile)
       itsMVar(0),
       itsProjectionVar(0),
       itsXFlip(false),
-      itsYFlip(false)
+      itsYFlip(false),
+      itsForceRowMajor(false),
+      itsUnpack(false),
+      itsCopyBufferSize(DEFAULT_COPY_BUFFER_SIZE),
+      itsChunkCacheSize(0),
+      itsChunkCacheSlots(0),
+      itsChunkCachePreemption(0),
+      itsTimesSorted(false),
+      itsValidated(false),
+      itsXResolutionDrift(0),
+      itsYResolutionDrift(0),
+      itsXResolutionCached(false),
+      itsYResolutionCached(false),
+      itsXResolution(kFloatMissing),
+      itsYResolution(kFloatMissing)
 {
 	Read(theInfile);
 }
 
 NFmiNetCDF::~NFmiNetCDF()
 {
-	itsDataFile->close();
+	UpdateMetadata();
+
+	lock_guard<recursive_mutex> lock(netcdfMutex);
+
+	if (itsDataFile)
+	{
+		itsDataFile->close();
+		itsDataFile.reset();
+	}
 }
 bool NFmiNetCDF::Read(const string& theInfile)
 {
+	UpdateMetadata();
+	itsSavedMetadata = -1;
+
+	lock_guard<recursive_mutex> lock(netcdfMutex);
+
+	itsFileName = theInfile;
 	itsDataFile = unique_ptr<NcFile>(new NcFile(theInfile.c_str(), NcFile::ReadOnly));
+	itsClassicFile.reset();
+	itsFileKey.clear();
+
+	itsTimes.clear();
+	itsLevels.clear();
+	itsSortedLevels.clear();
+	itsLongitudes.clear();
+	itsLatitudes.clear();
+	itsValidated = false;
+	itsXResolutionCached = false;
+	itsYResolutionCached = false;
 
 	if (!itsDataFile->is_valid())
 	{
 		return false;
 	}
 
-	// Read metadata from file.
+	// Read metadata from sidecar or file.
 
-	if (!ReadAttributes())
-		return false;
+	const bool identified =
+	    !itsMetadataCache.empty() && FileIdentity(itsFileName, itsFilePath, itsFileSize, itsFileMTime);
+	const bool cached = identified && LoadMetadata();
 
-	if (!ReadDimensions())
-		return false;
+	if (!cached)
+	{
+		if (!ReadAttributes())
+			return false;
 
-	if (!ReadVariables())
-		return false;
+		if (!ReadDimensions())
+			return false;
+
+		if (!ReadVariables())
+			return false;
+	}
 
 	if (itsParameters.size() == 0)
 	{
 		return false;
 	}
 
+	if (!CacheShapes())
+	{
+		fmt::print("Reading dimensions of variables failed\n");
+		return false;
+	}
+
+	// Axes and resolution are not read here; they are added to the sidecar when
+	// instance is destroyed, if they have been read by then
+
+	if (identified && !cached)
+	{
+		SaveMetadata();
+	}
+
+	SetChunkCache();
+
+	const auto format = itsDataFile->get_format();
+
+	if (!DISABLE_MMAP && (format == NcFile::Classic || format == NcFile::Offset64Bits))
+	{
+		itsClassicFile = NFmiClassicFile::Open(theInfile);
+	}
+
 	// Set initial time and level values since they are easily forgotten.
 
 	ResetTime();
@@ -183,34 +361,22 @@ bool NFmiNetCDF::Read(const string& theInfile)
 // Sizes
 long int NFmiNetCDF::SizeX() const
 {
-	long ret = 0;
-	if (itsXDim)
-		ret = itsXDim->size();
-	return ret;
+	return DimSize(itsXDim);
 }
 
 long int NFmiNetCDF::SizeY() const
 {
-	long ret = 0;
-	if (itsYDim)
-		ret = itsYDim->size();
-	return ret;
+	return DimSize(itsYDim);
 }
 
 long int NFmiNetCDF::SizeZ() const
 {
-	long ret = 0;
-	if (itsZDim)
-		ret = itsZDim->size();
-	return ret;
+	return DimSize(itsZDim);
 }
 
 long int NFmiNetCDF::SizeT() const
 {
-	long ret = 0;
-	if (itsTDim)
-		ret = itsTDim->size();
-	return ret;
+	return DimSize(itsTDim);
 }
 
 long int NFmiNetCDF::SizeParams() const
@@ -220,18 +386,22 @@ long int NFmiNetCDF::SizeParams() const
 // Types
 nc_type NFmiNetCDF::TypeX() const
 {
+	lock_guard<recursive_mutex> lock(netcdfMutex);
 	return itsXVar->type();
 }
 nc_type NFmiNetCDF::TypeY() const
 {
+	lock_guard<recursive_mutex> lock(netcdfMutex);
 	return itsYVar->type();
 }
 nc_type NFmiNetCDF::TypeZ() const
 {
+	lock_guard<recursive_mutex> lock(netcdfMutex);
 	return itsZVar->type();
 }
 nc_type NFmiNetCDF::TypeT() const
 {
+	lock_guard<recursive_mutex> lock(netcdfMutex);
 	return itsTVar->type();
 }
 // Metadata
@@ -247,19 +417,18 @@ double NFmiNetCDF::Orientation() const
 {
 	double ret = kFloatMissing;
 
-	NcVar* var = itsDataFile->get_var("stereographic");
+	const auto it = itsVariableIndex.find("stereographic");
 
-	if (!var)
+	if (it == itsVariableIndex.end())
 		return ret;
 
-	auto att = unique_ptr<NcAtt>(var->get_att("longitude_of_projection_origin"));
+	const Attribute* att = GetAtt(it->second, "longitude_of_projection_origin");
 
-	if (!att)
+	if (!att || att->values.empty())
 		return ret;
 
-	auto type = att->type();
-	auto val = (type == ncDouble) ? att->as_double(0) : att->as_float(0);
-	return ToSamePrecision<double>(val);
+	const double val = att->values[0];
+	return (att->type == ncDouble) ? ToSamePrecision<double>(val) : ToSamePrecision<double>(static_cast<float>(val));
 }
 
 std::string NFmiNetCDF::Projection() const
@@ -271,19 +440,18 @@ double NFmiNetCDF::TrueLatitude() const
 {
 	double ret = kFloatMissing;
 
-	NcVar* var = itsDataFile->get_var("stereographic");
+	const auto it = itsVariableIndex.find("stereographic");
 
-	if (!var)
+	if (it == itsVariableIndex.end())
 		return ret;
 
-	auto att = unique_ptr<NcAtt>(var->get_att("latitude_of_projection_origin"));
+	const Attribute* att = GetAtt(it->second, "latitude_of_projection_origin");
 
-	if (!att)
+	if (!att || att->values.empty())
 		return ret;
 
-	auto type = att->type();
-	auto val = (type == ncDouble) ? att->as_double(0) : att->as_float(0);
-	return ToSamePrecision<double>(val);
+	const double val = att->values[0];
+	return (att->type == ncDouble) ? ToSamePrecision<double>(val) : ToSamePrecision<double>(static_cast<float>(val));
 }
 
 // Params
@@ -316,12 +484,7 @@ bool NFmiNetCDF::NextTime()
 template <typename T>
 T NFmiNetCDF::Time()
 {
-	T val = static_cast<T>(kFloatMissing);
-
-	itsTVar->set_cur(&itsTimeIndex);
-	itsTVar->get(&val, 1);
-
-	return val;
+	return Time<T>(itsTimeIndex);
 }
 
 template float NFmiNetCDF::Time<float>();
@@ -331,13 +494,59 @@ template short NFmiNetCDF::Time<short>();
 template char NFmiNetCDF::Time<char>();
 template int8_t NFmiNetCDF::Time<int8_t>();
 
+const vector<double>& NFmiNetCDF::Times()
+{
+	if (itsTimes.empty() && itsTVar && SizeT() > 0)
+	{
+		lock_guard<recursive_mutex> lock(netcdfMutex);
+		itsTimes = ::Values<double>(itsDataFile->id(), itsTVar);
+		itsTimesSorted = std::is_sorted(itsTimes.begin(), itsTimes.end());
+	}
+
+	return itsTimes;
+}
+
+template <typename T>
+T NFmiNetCDF::Time(long theIndex)
+{
+	const auto& times = Times();
+
+	if (theIndex < 0 || theIndex >= static_cast<long>(times.size()))
+	{
+		return static_cast<T>(kFloatMissing);
+	}
+
+	return static_cast<T>(times[static_cast<size_t>(theIndex)]);
+}
+
+template float NFmiNetCDF::Time<float>(long);
+template double NFmiNetCDF::Time<double>(long);
+template int NFmiNetCDF::Time<int>(long);
+template short NFmiNetCDF::Time<short>(long);
+template char NFmiNetCDF::Time<char>(long);
+template int8_t NFmiNetCDF::Time<int8_t>(long);
+
+long NFmiNetCDF::FindTime(double theTime)
+{
+	const auto& times = Times();
+
+	if (itsTimesSorted)
+	{
+		const auto it = std::lower_bound(times.begin(), times.end(), theTime);
+		return (it == times.end() || *it != theTime) ? -1 : static_cast<long>(it - times.begin());
+	}
+
+	const auto it = std::find(times.begin(), times.end(), theTime);
+	return (it == times.end()) ? -1 : static_cast<long>(it - times.begin());
+}
+
 long NFmiNetCDF::TimeIndex()
 {
 	return itsTimeIndex;
 }
 string NFmiNetCDF::TimeUnit()
 {
-	return NFmiNetCDF::Att(itsTVar, "units");
+	return AttText(itsTVar, "units");
 }
 // Level
 void NFmiNetCDF::ResetLevel()
@@ -356,12 +565,88 @@ bool NFmiNetCDF::NextLevel()
 
 float NFmiNetCDF::Level()
 {
-	float val = kFloatMissing;
-	if (itsZVar)
+	return Level(itsLevelIndex);
+}
+
+const vector<float>& NFmiNetCDF::Levels()
+{
+	if (itsLevels.empty() && itsZVar)
+	{
+		lock_guard<recursive_mutex> lock(netcdfMutex);
+		itsLevels = ::Values<float>(itsDataFile->id(), itsZVar);
+		SortLevels();
+	}
+
+	return itsLevels;
+}
+
+void NFmiNetCDF::SortLevels()
+{
+	// sorted copy for value -> index lookups; level axis can be in
+	// any order (pressure levels descending, hybrid levels ascending, ..)
+
+	itsSortedLevels.clear();
+	itsSortedLevels.reserve(itsLevels.size());
+
+	for (size_t i = 0; i < itsLevels.size(); i++)
+	{
+		itsSortedLevels.emplace_back(itsLevels[i], static_cast<long>(i));
+	}
+
+	std::sort(itsSortedLevels.begin(), itsSortedLevels.end());
+}
+
+float NFmiNetCDF::Level(long theIndex)
+{
+	const auto& levels = Levels();
+
+	if (theIndex < 0 || theIndex >= static_cast<long>(levels.size()))
+	{
+		return kFloatMissing;
+	}
+
+	return levels[static_cast<size_t>(theIndex)];
+}
+
+long NFmiNetCDF::FindLevel(float theLevel)
+{
+	Levels();
+
+	const auto it = std::lower_bound(itsSortedLevels.begin(), itsSortedLevels.end(), make_pair(theLevel, 0L));
+
+	if (it == itsSortedLevels.end() || it->first != theLevel)
+	{
+		return -1;
+	}
+
+	return it->second;
+}
+
+long NFmiNetCDF::FindNearestLevel(float theLevel)
+{
+	Levels();
+
+	if (itsSortedLevels.empty())
 	{
-		val = itsZVar->as_float(itsLevelIndex);
+		return -1;
 	}
-	return val;
+
+	const auto it = std::lower_bound(itsSortedLevels.begin(), itsSortedLevels.end(), make_pair(theLevel, 0L));
+
+	if (it == itsSortedLevels.begin())
+	{
+		return it->second;
+	}
+	else if (it == itsSortedLevels.end())
+	{
+		return prev(it)->second;
+	}
+
+	// lower_bound gives the first level >= theLevel; choose between that and the
+	// previous (smaller) level. On a tie prefer the smaller level
+
+	const auto lower = prev(it);
+	return (theLevel - lower->first <= it->first - theLevel) ? lower->second : it->second;
 }
 
 long NFmiNetCDF::LevelIndex()
@@ -371,18 +656,14 @@ long NFmiNetCDF::LevelIndex()
 template <typename T>
 vector<T> NFmiNetCDF::Values(const std::string& theParameter)
 {
-	vector<T> values;
+	NcVar* var = FindParameter(theParameter);
 
-	for (unsigned int i = 0; i < itsParameters.size(); i++)
+	if (!var)
 	{
-		if (itsParameters[i]->name() == theParameter)
-		{
-			values = Values<T>(itsParameters[i], TimeIndex(), LevelIndex());
-			break;
-		}
+		return vector<T>();
 	}
 
-	return values;
+	return Values<T>(var, TimeIndex(), LevelIndex());
 }
 
 template vector<float> NFmiNetCDF::Values(const std::string&);
@@ -397,133 +678,1066 @@ vector<T> NFmiNetCDF::Values()
 template vector<float> NFmiNetCDF::Values();
 template vector<double> NFmiNetCDF::Values();
 
-NcVar* NFmiNetCDF::GetVariable(const string& varName) const
+template <typename T>
+bool NFmiNetCDF::Values(const std::string& theParameter, T* theBuffer, size_t theSize)
 {
-	for (unsigned int i = 0; i < itsParameters.size(); i++)
+	NcVar* var = FindParameter(theParameter);
+
+	if (!var)
 	{
-		if (string(itsParameters[i]->name()) == varName)
-			return itsParameters[i];
+		return false;
 	}
-	throw out_of_range("Variable '" + varName + "' does not exist");
+
+	return Values<T>(var, TimeIndex(), LevelIndex(), theBuffer, theSize);
 }
 
-NcVar* NFmiNetCDF::GetProjectionVariable() const
+template bool NFmiNetCDF::Values(const std::string&, float*, size_t);
+template bool NFmiNetCDF::Values(const std::string&, double*, size_t);
+
+template <typename T>
+bool NFmiNetCDF::Values(T* theBuffer, size_t theSize)
 {
-	if (!itsProjectionVar)
-	{
-		throw out_of_range("Projection variable does not exist");
-	}
+	return Values<T>(Param(), TimeIndex(), LevelIndex(), theBuffer, theSize);
+}
 
-	return itsProjectionVar;
+template bool NFmiNetCDF::Values(float*, size_t);
+template bool NFmiNetCDF::Values(double*, size_t);
+
+template <typename T>
+vector<T> NFmiNetCDF::Values(NcVar* theParameter)
+{
+	return Values<T>(theParameter, TimeIndex(), LevelIndex());
 }
 
-bool NFmiNetCDF::HasVariable(const string& name) const
+template vector<float> NFmiNetCDF::Values(NcVar*);
+template vector<double> NFmiNetCDF::Values(NcVar*);
+
+template <typename T>
+bool NFmiNetCDF::Values(NcVar* theParameter, T* theBuffer, size_t theSize)
 {
-	NcVar* var = itsDataFile->get_var(name.c_str());
-	return var == nullptr ? false : true;
+	return Values<T>(theParameter, TimeIndex(), LevelIndex(), theBuffer, theSize);
 }
 
-/*
- * WriteSlice(string)
- *
- * Write the current slice to file. Slice means the level/parameter combination that
- * is defined by the iterators.
- *
- * If iterators are not valid, WriteSlice() returns false.
- * If a parameter has no z dimension, WriteSlice() will ignore z iterator value.
- *
- */
+template bool NFmiNetCDF::Values(NcVar*, float*, size_t);
+template bool NFmiNetCDF::Values(NcVar*, double*, size_t);
 
-bool NFmiNetCDF::WriteSlice(const std::string& theFileName)
+size_t NFmiNetCDF::SliceSize(const std::string& theParameter)
 {
-	NcDim *theXDim = 0, *theYDim = 0, *theZDim = 0, *theTDim = 0, *theMDim = 0;
-	NcVar *theXVar = 0, *theYVar = 0, *theZVar = 0, *theTVar = 0, *theMVar = 0, *outvar = 0;
+	size_t cursor_position[NC_MAX_VAR_DIMS], dimsizes[NC_MAX_VAR_DIMS];
 
-	boost::filesystem::path f(theFileName);
-	string dir = f.parent_path().string();
+	const NcVar* var = FindParameter(theParameter);
 
-	if (!boost::filesystem::exists(dir))
+	if (!var)
 	{
-		if (!boost::filesystem::create_directories(dir))
-		{
-			fmt::print("Unable to create directory {}\n", dir);
-			return false;
-		}
+		return 0;
 	}
 
-	NcFile theOutFile(theFileName.c_str(), NcFile::Replace);
+	return SliceShape(var, TimeIndex(), LevelIndex(), cursor_position, dimsizes);
+}
 
-	if (!theOutFile.is_valid())
+size_t NFmiNetCDF::SliceSize()
+{
+	size_t cursor_position[NC_MAX_VAR_DIMS], dimsizes[NC_MAX_VAR_DIMS];
+	return SliceShape(Param(), TimeIndex(), LevelIndex(), cursor_position, dimsizes);
+}
+
+size_t NFmiNetCDF::SliceSize(const std::string& theParameter, long theTimeCount, long theLevelCount)
+{
+	size_t cursor_position[NC_MAX_VAR_DIMS], dimsizes[NC_MAX_VAR_DIMS];
+
+	const NcVar* var = FindParameter(theParameter);
+
+	if (!var)
 	{
-		fmt::print("Unable to create file {}\n", theFileName);
-		return false;
+		return 0;
 	}
 
-	// Dimensions
+	return SliceShape(var, 0, 0, cursor_position, dimsizes, theTimeCount, theLevelCount);
+}
 
-	if (!(theXDim = theOutFile.add_dim(itsXDim->name(), SizeX())))
+template <typename T>
+bool NFmiNetCDF::Values(const std::string& theParameter, long theFirstTime, long theTimeCount, long theFirstLevel,
+                        long theLevelCount, T* theBuffer, size_t theSize)
+{
+	NcVar* var = FindParameter(theParameter);
+
+	if (!var)
 	{
 		return false;
 	}
 
-	if (!(theYDim = theOutFile.add_dim(itsYDim->name(), SizeY())))
+	if (theFirstTime < 0 || theTimeCount < 1 || theFirstTime + theTimeCount > SizeT())
 	{
+		fmt::print("Invalid time range for {}: {} + {}\n", theParameter, theFirstTime, theTimeCount);
 		return false;
 	}
 
-	// Add z dimension if it exists in the original data
-
-	if (itsZDim)
+	if (itsZDim && (theFirstLevel < 0 || theLevelCount < 1 || theFirstLevel + theLevelCount > SizeZ()))
 	{
-		if (!(theZDim = theOutFile.add_dim(itsZDim->name(), 1)))
-		{
-			return false;
-		}
+		fmt::print("Invalid level range for {}: {} + {}\n", theParameter, theFirstLevel, theLevelCount);
+		return false;
 	}
 
-	// Our unlimited dimension
+	return Values<T>(var, theFirstTime, theFirstLevel, theBuffer, theSize, theTimeCount, theLevelCount);
+}
 
-	if (itsTDim)
-	{
-		if (!(theTDim = theOutFile.add_dim(itsTDim->name())))
-		{
-			return false;
-		}
-	}
+template bool NFmiNetCDF::Values(const std::string&, long, long, long, long, float*, size_t);
+template bool NFmiNetCDF::Values(const std::string&, long, long, long, long, double*, size_t);
 
-	// ensemble member dimension
-	if (itsMDim)
+template <typename T>
+vector<T> NFmiNetCDF::Values(const std::string& theParameter, long theFirstTime, long theTimeCount, long theFirstLevel,
+                             long theLevelCount)
+{
+	if (theTimeCount < 1 || theLevelCount < 1)
 	{
-		const size_t sizeM = itsMDim->size();
-		if (!(theMDim = theOutFile.add_dim(itsMDim->name(), sizeM)))
-		{
-			return false;
-		}
+		return vector<T>();
 	}
 
-	// Variables
-
-	// x
+	vector<T> values(SliceSize(theParameter, theTimeCount, theLevelCount));
 
-	if (!CopyVar(&theXVar, itsXVar, &theOutFile, nullptr, nullptr))
+	if (values.empty() || !Values<T>(theParameter, theFirstTime, theTimeCount, theFirstLevel, theLevelCount,
+	                                 values.data(), values.size()))
 	{
-		return false;
+		return vector<T>();
 	}
 
-	/*
-	    if (itsXFlip) reverse(xValues.begin(), xValues.end());
+	return values;
+}
 
-	*/
-	// y
+template vector<float> NFmiNetCDF::Values(const std::string&, long, long, long, long);
+template vector<double> NFmiNetCDF::Values(const std::string&, long, long, long, long);
 
-	if (!CopyVar(&theYVar, itsYVar, &theOutFile, nullptr, nullptr))
-	{
-		return false;
+bool NFmiNetCDF::ValidWindow(const IndexWindow& theWindow) const
+{
+	return (theWindow.x0 >= 0 && theWindow.nx > 0 && theWindow.x0 + theWindow.nx <= SizeX() && theWindow.y0 >= 0 &&
+	        theWindow.ny > 0 && theWindow.y0 + theWindow.ny <= SizeY());
+}
+
+template <typename T>
+bool NFmiNetCDF::Values(const std::string& theParameter, const IndexWindow& theWindow, T* theBuffer, size_t theSize)
+{
+	NcVar* var = FindParameter(theParameter);
+
+	if (!var)
+	{
+		return false;
+	}
+
+	if (!ValidWindow(theWindow))
+	{
+		fmt::print("Invalid window for {}: x {} + {}, y {} + {}\n", theParameter, theWindow.x0, theWindow.nx,
+		           theWindow.y0, theWindow.ny);
+		return false;
+	}
+
+	return Values<T>(var, TimeIndex(), LevelIndex(), theBuffer, theSize, 1, 1, &theWindow);
+}
+
+template bool NFmiNetCDF::Values(const std::string&, const IndexWindow&, float*, size_t);
+template bool NFmiNetCDF::Values(const std::string&, const IndexWindow&, double*, size_t);
+
+template <typename T>
+vector<T> NFmiNetCDF::Values(const std::string& theParameter, const IndexWindow& theWindow)
+{
+	if (!ValidWindow(theWindow))
+	{
+		return vector<T>();
+	}
+
+	vector<T> values(static_cast<size_t>(theWindow.nx * theWindow.ny));
+
+	if (!Values<T>(theParameter, theWindow, values.data(), values.size()))
+	{
+		return vector<T>();
+	}
+
+	return values;
+}
+
+template vector<float> NFmiNetCDF::Values(const std::string&, const IndexWindow&);
+template vector<double> NFmiNetCDF::Values(const std::string&, const IndexWindow&);
+
+template <typename T>
+vector<T> NFmiNetCDF::Values(const std::string& theParameter, const BoundingBox& theBox)
+{
+	IndexWindow window;
+
+	if (!FindWindow(theBox, window))
+	{
+		return vector<T>();
+	}
+
+	return Values<T>(theParameter, window);
+}
+
+template vector<float> NFmiNetCDF::Values(const std::string&, const BoundingBox&);
+template vector<double> NFmiNetCDF::Values(const std::string&, const BoundingBox&);
+
+/*
+ * ReadGeographicAxes()
+ *
+ * Fill itsLongitudes and itsLatitudes for FindWindow(). Returns false if grid
+ * has no geographic coordinates that can be used.
+ */
+
+bool NFmiNetCDF::ReadGeographicAxes()
+{
+	if (!itsLongitudes.empty())
+	{
+		return true;
+	}
+
+	if (!itsXVar || !itsYVar || !itsXDim || !itsYDim)
+	{
+		return false;
+	}
+
+	lock_guard<recursive_mutex> lock(netcdfMutex);
+
+	if (itsProjection == "latitude_longitude")
+	{
+		itsLongitudes = ::Values<double>(itsDataFile->id(), itsXVar);
+		itsLatitudes = ::Values<double>(itsDataFile->id(), itsYVar);
+
+		return (!itsLongitudes.empty() && !itsLatitudes.empty());
+	}
+
+	const auto lonit = itsVariableIndex.find("longitude");
+	const auto latit = itsVariableIndex.find("latitude");
+
+	if (lonit == itsVariableIndex.end() || latit == itsVariableIndex.end())
+	{
+		return false;
+	}
+
+	const NcVar* lonvar = lonit->second;
+	const NcVar* latvar = latit->second;
+
+	if (lonvar->num_dims() != 2 || latvar->num_dims() != 2)
+	{
+		return false;
+	}
+
+	const size_t nx = static_cast<size_t>(SizeX());
+	const size_t ny = static_cast<size_t>(SizeY());
+
+	// 2D coordinates are stored in (y, x) order here; (x, y) variables are transposed
+
+	auto read = [&](const NcVar* var, vector<double>& values)
+	{
+		if (var->get_dim(0) == itsYDim && var->get_dim(1) == itsXDim)
+		{
+			values = ::Values<double>(itsDataFile->id(), var);
+		}
+		else if (var->get_dim(0) == itsXDim && var->get_dim(1) == itsYDim)
+		{
+			vector<double> scratch;
+
+			values = ::Values<double>(itsDataFile->id(), var);
+			TransposeSlice(values.data(), nx, ny, scratch);
+		}
+
+		return (values.size() == nx * ny);
+	};
+
+	if (!read(lonvar, itsLongitudes) || !read(latvar, itsLatitudes))
+	{
+		itsLongitudes.clear();
+		itsLatitudes.clear();
+		return false;
+	}
+
+	return true;
+}
+
+bool InLatRange(double lat, const NFmiNetCDF::BoundingBox& box)
+{
+	return (lat >= box.minLat && lat <= box.maxLat);
+}
+
+// Longitudes are compared modulo 360, so grids in 0..360 and boxes in
+// -180..180 (or the other way around) match
+
+bool InLonRange(double lon, const NFmiNetCDF::BoundingBox& box)
+{
+	const double width = std::fmod(std::fmod(box.maxLon - box.minLon, 360.) + 360., 360.);
+	const double dist = std::fmod(std::fmod(lon - box.minLon, 360.) + 360., 360.);
+
+	return (dist <= width || box.maxLon - box.minLon >= 360.);
+}
+
+bool NFmiNetCDF::FindWindow(const BoundingBox& theBox, IndexWindow& theWindow)
+{
+	if (!ReadGeographicAxes())
+	{
+		fmt::print("No geographic coordinates to map bounding box to grid\n");
+		return false;
+	}
+
+	long x0 = SizeX(), x1 = -1, y0 = SizeY(), y1 = -1;
+
+	if (itsProjection == "latitude_longitude")
+	{
+		// axes can be in either direction, so all values are checked
+
+		for (size_t i = 0; i < itsLongitudes.size(); i++)
+		{
+			if (InLonRange(itsLongitudes[i], theBox))
+			{
+				x0 = std::min(x0, static_cast<long>(i));
+				x1 = std::max(x1, static_cast<long>(i));
+			}
+		}
+
+		for (size_t j = 0; j < itsLatitudes.size(); j++)
+		{
+			if (InLatRange(itsLatitudes[j], theBox))
+			{
+				y0 = std::min(y0, static_cast<long>(j));
+				y1 = std::max(y1, static_cast<long>(j));
+			}
+		}
+	}
+	else
+	{
+		const size_t nx = static_cast<size_t>(SizeX());
+
+		for (size_t i = 0; i < itsLongitudes.size(); i++)
+		{
+			if (InLatRange(itsLatitudes[i], theBox) && InLonRange(itsLongitudes[i], theBox))
+			{
+				x0 = std::min(x0, static_cast<long>(i % nx));
+				x1 = std::max(x1, static_cast<long>(i % nx));
+				y0 = std::min(y0, static_cast<long>(i / nx));
+				y1 = std::max(y1, static_cast<long>(i / nx));
+			}
+		}
+	}
+
+	if (x1 < x0 || y1 < y0)
+	{
+		return false;
+	}
+
+	theWindow.x0 = x0;
+	theWindow.y0 = y0;
+	theWindow.nx = x1 - x0 + 1;
+	theWindow.ny = y1 - y0 + 1;
+
+	return true;
+}
+
+// Fractional index of value on a monotonic axis, or -1 if value is outside the axis
+
+double AxisIndex(const vector<double>& axis, double value)
+{
+	if (axis.empty() || std::isnan(value))
+	{
+		return -1;
+	}
+
+	if (axis.size() == 1)
+	{
+		return (value == axis[0]) ? 0 : -1;
+	}
+
+	const bool ascending = axis.back() >= axis.front();
+	const auto it = ascending ? std::lower_bound(axis.begin(), axis.end(), value)
+	                          : std::lower_bound(axis.begin(), axis.end(), value, std::greater<double>());
+
+	if (it == axis.end())
+	{
+		return -1;
+	}
+
+	const size_t i = static_cast<size_t>(it - axis.begin());
+
+	if (*it == value)
+	{
+		return static_cast<double>(i);
+	}
+
+	if (i == 0)
+	{
+		return -1;
+	}
+
+	return static_cast<double>(i - 1) + (value - axis[i - 1]) / (axis[i] - axis[i - 1]);
+}
+
+vector<NFmiNetCDF::GridPoint> NFmiNetCDF::FindGridPoints(const vector<LatLon>& thePoints)
+{
+	vector<GridPoint> points(thePoints.size(), GridPoint{-1, -1});
+
+	if (itsProjection != "latitude_longitude" || !ReadGeographicAxes())
+	{
+		fmt::print("Lat/lon points can be mapped to grid only in latitude_longitude projection\n");
+		return points;
+	}
+
+	const double minLon = *std::min_element(itsLongitudes.begin(), itsLongitudes.end());
+
+	for (size_t i = 0; i < thePoints.size(); i++)
+	{
+		// longitude to the range of the axis: grids can be in 0..360 or -180..180
+
+		const double lon = minLon + std::fmod(std::fmod(thePoints[i].lon - minLon, 360.) + 360., 360.);
+
+		const double x = AxisIndex(itsLongitudes, lon);
+		const double y = AxisIndex(itsLatitudes, thePoints[i].lat);
+
+		if (x >= 0 && y >= 0)
+		{
+			points[i] = GridPoint{x, y};
+		}
+	}
+
+	return points;
+}
+
+template <typename T>
+vector<T> NFmiNetCDF::PointValues(const std::string& theParameter, const vector<GridPoint>& thePoints,
+                                  long theFirstTime, long theTimeCount, long theLevelIndex, bool theInterpolate)
+{
+	NcVar* var = FindParameter(theParameter);
+
+	if (!var || thePoints.empty())
+	{
+		return vector<T>();
+	}
+
+	if (theFirstTime < 0 || theTimeCount < 1 || theFirstTime + theTimeCount > SizeT())
+	{
+		fmt::print("Invalid time range for {}: {} + {}\n", theParameter, theFirstTime, theTimeCount);
+		return vector<T>();
+	}
+
+	// Dimensions are taken from the shapes cached by Read(), so that only the
+	// reads of the library fallback take the library mutex
+
+	const auto& dims = itsVariableDims[static_cast<size_t>(var->id())];
+	const int xDim = itsXDim ? itsXDim->id() : -1, yDim = itsYDim ? itsYDim->id() : -1;
+	const int zDim = itsZDim ? itsZDim->id() : -1, tDim = itsTDim ? itsTDim->id() : -1;
+
+	bool hasX = false, hasY = false, hasZ = false;
+
+	for (int dim : dims)
+	{
+		hasX |= (dim == xDim);
+		hasY |= (dim == yDim);
+		hasZ |= (dim == zDim);
+
+		if (dim != xDim && dim != yDim && dim != tDim && dim != zDim && itsDimSizes[static_cast<size_t>(dim)] > 1)
+		{
+			lock_guard<recursive_mutex> lock(netcdfMutex);
+			fmt::print("Point values not supported for {}: extra dimension {}\n", theParameter,
+			           itsDataFile->get_dim(dim)->name());
+			return vector<T>();
+		}
+	}
+
+	if (!hasX || !hasY)
+	{
+		fmt::print("Parameter {} has no x and y dimensions\n", theParameter);
+		return vector<T>();
+	}
+
+	if (hasZ && (theLevelIndex < 0 || theLevelIndex >= SizeZ()))
+	{
+		fmt::print("Invalid level index for {}: {}\n", theParameter, theLevelIndex);
+		return vector<T>();
+	}
+
+	// Grid cells needed by each point: corners (x0, y0) .. (x1, y1) and weights
+
+	struct Footprint
+	{
+		long x0, y0, x1, y1;
+		double fx, fy;
+		bool valid;
+	};
+
+	const long nx = SizeX(), ny = SizeY();
+
+	vector<Footprint> footprints(thePoints.size());
+
+	long bx0 = nx, by0 = ny, bx1 = -1, by1 = -1;
+	size_t cells = 0;
+
+	for (size_t p = 0; p < thePoints.size(); p++)
+	{
+		const double x = thePoints[p].x, y = thePoints[p].y;
+		Footprint& f = footprints[p];
+
+		f.valid = (x >= 0 && x <= static_cast<double>(nx - 1) && y >= 0 && y <= static_cast<double>(ny - 1));
+
+		if (!f.valid)
+		{
+			continue;
+		}
+
+		if (theInterpolate)
+		{
+			f.x0 = static_cast<long>(std::floor(x));
+			f.y0 = static_cast<long>(std::floor(y));
+			f.fx = x - static_cast<double>(f.x0);
+			f.fy = y - static_cast<double>(f.y0);
+			f.x1 = (f.fx > 0) ? f.x0 + 1 : f.x0;
+			f.y1 = (f.fy > 0) ? f.y0 + 1 : f.y0;
+		}
+		else
+		{
+			f.x0 = f.x1 = std::lround(x);
+			f.y0 = f.y1 = std::lround(y);
+			f.fx = f.fy = 0;
+		}
+
+		bx0 = std::min(bx0, f.x0);
+		by0 = std::min(by0, f.y0);
+		bx1 = std::max(bx1, f.x1);
+		by1 = std::max(by1, f.y1);
+
+		cells += static_cast<size_t>((f.x1 - f.x0 + 1) * (f.y1 - f.y0 + 1));
+	}
+
+	const size_t timeCount = static_cast<size_t>(theTimeCount);
+
+	vector<T> result(thePoints.size() * timeCount, static_cast<T>(kFloatMissing));
+
+	if (bx1 < 0)
+	{
+		return result;
+	}
+
+	const long levelIndex = hasZ ? theLevelIndex : -1;
+
+	// Fill values are mapped to kFloatMissing also without unpacking, when
+	// values are otherwise read as stored
+
+	DecodeParams params = UnpackParams(*this, var);
+
+	if (!itsUnpack)
+	{
+		params.scale = 1;
+		params.offset = 0;
+	}
+
+	vector<T> buffer;
+	size_t tStride = 0, yStride = 0, xStride = 0;
+
+	// Read window over times, strides of t, y and x in buffer are computed from
+	// the dimension order of the variable
+
+	auto read = [&](const IndexWindow& window, long firstTime, long count)
+	{
+		size_t start[NC_MAX_VAR_DIMS], counts[NC_MAX_VAR_DIMS];
+
+		buffer.resize(SliceShape(var, firstTime, levelIndex, start, counts, count, 1, &window));
+
+		size_t stride = 1;
+		tStride = 0;
+
+		for (size_t i = dims.size(); i-- > 0;)
+		{
+			if (dims[i] == tDim)
+				tStride = stride;
+			else if (dims[i] == yDim)
+				yStride = stride;
+			else if (dims[i] == xDim)
+				xStride = stride;
+
+			stride *= counts[i];
+		}
+
+		return ReadSlab(var, start, counts, buffer.data(), buffer.size(), params);
+	};
+
+	auto missing = [&](T v) { return v == static_cast<T>(kFloatMissing) || !std::isfinite(v); };
+
+	auto sample = [&](const Footprint& f, const IndexWindow& window, size_t offset) -> T
+	{
+		auto at = [&](long x, long y)
+		{
+			return buffer[offset + static_cast<size_t>(y - window.y0) * yStride +
+			              static_cast<size_t>(x - window.x0) * xStride];
+		};
+
+		const T c00 = at(f.x0, f.y0), c10 = at(f.x1, f.y0), c01 = at(f.x0, f.y1), c11 = at(f.x1, f.y1);
+
+		if (missing(c00) || missing(c10) || missing(c01) || missing(c11))
+		{
+			return static_cast<T>(kFloatMissing);
+		}
+
+		const double v00 = c00, v10 = c10, v01 = c01, v11 = c11;
+
+		return static_cast<T>((1 - f.fy) * ((1 - f.fx) * v00 + f.fx * v10) + f.fy * ((1 - f.fx) * v01 + f.fx * v11));
+	};
+
+	const IndexWindow bounds{bx0, by0, bx1 - bx0 + 1, by1 - by0 + 1};
+	const size_t boundsCells = static_cast<size_t>(bounds.nx * bounds.ny);
+
+	if (boundsCells <= DENSE_POINT_FACTOR * cells)
+	{
+		// bounding window of all points, as many time steps at a time as fit to copy buffer size
+
+		const long step = std::max(1L, static_cast<long>(itsCopyBufferSize / (boundsCells * sizeof(T))));
+
+		for (long t = 0; t < theTimeCount; t += step)
+		{
+			const long count = std::min(step, theTimeCount - t);
+
+			if (!read(bounds, theFirstTime + t, count))
+			{
+				return vector<T>();
+			}
+
+			for (size_t p = 0; p < thePoints.size(); p++)
+			{
+				if (!footprints[p].valid)
+				{
+					continue;
+				}
+
+				for (long k = 0; k < count; k++)
+				{
+					result[p * timeCount + static_cast<size_t>(t + k)] =
+					    sample(footprints[p], bounds, static_cast<size_t>(k) * tStride);
+				}
+			}
+		}
+	}
+	else
+	{
+		// one hyperslab of at most 2 x 2 cells over all times for each point
+
+		for (size_t p = 0; p < thePoints.size(); p++)
+		{
+			const Footprint& f = footprints[p];
+
+			if (!f.valid)
+			{
+				continue;
+			}
+
+			const IndexWindow window{f.x0, f.y0, f.x1 - f.x0 + 1, f.y1 - f.y0 + 1};
+
+			if (!read(window, theFirstTime, theTimeCount))
+			{
+				return vector<T>();
+			}
+
+			for (size_t k = 0; k < timeCount; k++)
+			{
+				result[p * timeCount + k] = sample(f, window, k * tStride);
+			}
+		}
+	}
+
+	return result;
+}
+
+template vector<float> NFmiNetCDF::PointValues(const std::string&, const vector<GridPoint>&, long, long, long, bool);
+template vector<double> NFmiNetCDF::PointValues(const std::string&, const vector<GridPoint>&, long, long, long, bool);
+
+template <typename T>
+vector<T> NFmiNetCDF::PointValues(const std::string& theParameter, const vector<LatLon>& thePoints, long theFirstTime,
+                                  long theTimeCount, long theLevelIndex, bool theInterpolate)
+{
+	return PointValues<T>(theParameter, FindGridPoints(thePoints), theFirstTime, theTimeCount, theLevelIndex,
+	                      theInterpolate);
+}
+
+template vector<float> NFmiNetCDF::PointValues(const std::string&, const vector<LatLon>&, long, long, long, bool);
+template vector<double> NFmiNetCDF::PointValues(const std::string&, const vector<LatLon>&, long, long, long, bool);
+
+unique_ptr<NFmiNetCDF> NFmiNetCDF::Reopen() const
+{
+	unique_ptr<NFmiNetCDF> nc(new NFmiNetCDF());
+
+	nc->itsUnpack = itsUnpack;
+	nc->itsXFlip = itsXFlip;
+	nc->itsYFlip = itsYFlip;
+	nc->itsForceRowMajor = itsForceRowMajor;
+	nc->itsSliceCache = itsSliceCache;
+	nc->itsMetadataCache = itsMetadataCache;
+	nc->ChunkCache(itsChunkCacheSize, itsChunkCacheSlots, itsChunkCachePreemption);
+
+	if (!nc->Read(itsFileName))
+	{
+		fmt::print("Unable to open file {}\n", itsFileName);
+		nc.reset();
+	}
+
+	return nc;
+}
+
+template <typename T>
+vector<vector<T>> NFmiNetCDF::Values(const vector<SliceRequest>& theRequests, unsigned int theThreadCount)
+{
+	vector<vector<T>> ret(theRequests.size());
+
+	if (theRequests.empty() || !itsDataFile)
+	{
+		return ret;
+	}
+
+	if (theThreadCount == 0)
+	{
+		theThreadCount = std::max(1u, thread::hardware_concurrency());
+	}
+
+	theThreadCount = static_cast<unsigned int>(std::min(static_cast<size_t>(theThreadCount), theRequests.size()));
+
+	// Each thread reads from its own handle. Memory mapped classic files are
+	// read in parallel, reads through the library (netcdf4 files, or when
+	// mapping is not available) and opening and closing the handles are
+	// serialized, see ReadSlab().
+
+	atomic<size_t> next(0);
+
+	auto worker = [&]()
+	{
+		unique_ptr<NFmiNetCDF> nc = Reopen();
+
+		if (!nc)
+		{
+			return;
+		}
+
+		for (size_t i = next++; i < theRequests.size(); i = next++)
+		{
+			nc->Values<T>(theRequests[i], ret[i]);
+		}
+	};
+
+	vector<thread> threads;
+	threads.reserve(theThreadCount);
+
+	for (unsigned int i = 0; i < theThreadCount; i++)
+	{
+		threads.emplace_back(worker);
+	}
+
+	for (auto& t : threads)
+	{
+		t.join();
+	}
+
+	return ret;
+}
+
+template vector<vector<float>> NFmiNetCDF::Values(const vector<SliceRequest>&, unsigned int);
+template vector<vector<double>> NFmiNetCDF::Values(const vector<SliceRequest>&, unsigned int);
+
+template <typename T>
+bool NFmiNetCDF::Values(const SliceRequest& theRequest, vector<T>& theValues)
+{
+	NcVar* var = FindParameter(theRequest.param);
+
+	if (!var)
+	{
+		fmt::print("Parameter {} not found\n", theRequest.param);
+		theValues.clear();
+		return false;
+	}
+
+	size_t cursor_position[NC_MAX_VAR_DIMS], dimsizes[NC_MAX_VAR_DIMS];
+	theValues.resize(SliceShape(var, theRequest.timeIndex, theRequest.levelIndex, cursor_position, dimsizes));
+
+	if (!Values<T>(var, theRequest.timeIndex, theRequest.levelIndex, theValues.data(), theValues.size()))
+	{
+		fmt::print("Reading parameter {} time {} level {} failed\n", theRequest.param, theRequest.timeIndex,
+		           theRequest.levelIndex);
+		theValues.clear();
+		return false;
+	}
+
+	return true;
+}
+
+template bool NFmiNetCDF::Values(const SliceRequest&, vector<float>&);
+template bool NFmiNetCDF::Values(const SliceRequest&, vector<double>&);
+
+NcVar* NFmiNetCDF::GetVariable(const string& varName) const
+{
+	NcVar* var = FindParameter(varName);
+
+	if (!var)
+	{
+		throw out_of_range("Variable '" + varName + "' does not exist");
+	}
+
+	return var;
+}
+
+NcVar* NFmiNetCDF::FindParameter(const string& theParameter) const
+{
+	const auto it = itsParameterIndex.find(theParameter);
+	return (it == itsParameterIndex.end()) ? nullptr : it->second;
+}
+
+NcVar* NFmiNetCDF::GetProjectionVariable() const
+{
+	if (!itsProjectionVar)
+	{
+		throw out_of_range("Projection variable does not exist");
+	}
+
+	return itsProjectionVar;
+}
+
+bool NFmiNetCDF::HasVariable(const string& name) const
+{
+	return itsVariableIndex.find(name) != itsVariableIndex.end();
+}
+
+bool NFmiNetCDF::HasParameter(const string& theParameter) const
+{
+	return FindParameter(theParameter) != nullptr;
+}
+
+bool NFmiNetCDF::HasLevels(const string& theParameter) const
+{
+	const NcVar* var = FindParameter(theParameter);
+
+	if (!var || !itsZDim)
+	{
+		return false;
+	}
+
+	const auto& dims = itsVariableDims[static_cast<size_t>(var->id())];
+
+	return std::find(dims.begin(), dims.end(), itsZDim->id()) != dims.end();
+}
+
+/*
+ * WriteSlice(string)
+ *
+ * Write the current slice to file. Slice means the level/parameter combination that
+ * is defined by the iterators.
+ *
+ * If iterators are not valid, WriteSlice() returns false.
+ * If a parameter has no z dimension, WriteSlice() will ignore z iterator value.
+ *
+ */
+
+bool NFmiNetCDF::WriteSlice(const std::string& theFileName)
+{
+	return WriteSlice(theFileName, itsWriteOptions);
+}
+
+bool NFmiNetCDF::WriteSlice(const std::string& theFileName, const WriteOptions& theOptions)
+{
+	lock_guard<recursive_mutex> lock(netcdfMutex);
+
+	NcVar* var = Param();
+
+	long levelIndex = LevelIndex();
+
+	if (itsZDim && !HasDimension(var, "z") && (levelIndex < 0 || levelIndex >= SizeZ()))
+	{
+		levelIndex = 0;
+	}
+
+	return WriteSlices(theFileName, {var->name()}, {TimeIndex()}, itsZDim ? vector<long>{levelIndex} : vector<long>(),
+	                   theOptions);
+}
+
+/*
+ * WriteSlices(string, params, times, levels)
+ *
+ * Write a selection of parameters, times and levels to one file. Empty selection
+ * means all parameters/times/levels. All dimensions, variables and attributes are
+ * defined first, and data is written after that so that the file leaves define
+ * mode only once. Consecutive time and level indexes are copied with one
+ * hyperslab request.
+ *
+ */
+
+bool NFmiNetCDF::WriteSlices(const std::string& theFileName, const std::vector<std::string>& theParameters,
+                             const std::vector<long>& theTimeIndexes, const std::vector<long>& theLevelIndexes)
+{
+	return WriteSlices(theFileName, theParameters, theTimeIndexes, theLevelIndexes, itsWriteOptions);
+}
+
+bool NFmiNetCDF::WriteSlices(const std::string& theFileName, const std::vector<std::string>& theParameters,
+                             const std::vector<long>& theTimeIndexes, const std::vector<long>& theLevelIndexes,
+                             const WriteOptions& theOptions)
+{
+	// Output file is created, defined and written through the library, and
+	// packed parameters are read with ReadSlab(); the whole write holds the
+	// library mutex
+
+	lock_guard<recursive_mutex> lock(netcdfMutex);
+
+	// Resolve selection
+
+	vector<NcVar*> params;
+
+	if (theParameters.empty())
+	{
+		params = itsParameters;
+	}
+
+	for (const auto& name : theParameters)
+	{
+		NcVar* var = FindParameter(name);
+
+		if (!var)
+		{
+			fmt::print("Parameter {} not found\n", name);
+			return false;
+		}
+
+		params.push_back(var);
+	}
+
+	vector<long> times = theTimeIndexes;
+
+	if (times.empty())
+	{
+		times.resize(static_cast<size_t>(SizeT()));
+		iota(times.begin(), times.end(), 0L);
+	}
+
+	vector<long> levels;
+
+	if (itsZDim)
+	{
+		levels = theLevelIndexes;
+
+		if (levels.empty())
+		{
+			levels.resize(static_cast<size_t>(SizeZ()));
+			iota(levels.begin(), levels.end(), 0L);
+		}
+	}
+
+	for (long t : times)
+	{
+		if (t < 0 || t >= SizeT())
+		{
+			fmt::print("Invalid time index: {}\n", t);
+			return false;
+		}
+	}
+
+	for (long z : levels)
+	{
+		if (z < 0 || z >= SizeZ())
+		{
+			fmt::print("Invalid level index: {}\n", z);
+			return false;
+		}
+	}
+
+	boost::filesystem::path f(theFileName);
+	string dir = f.parent_path().string();
+
+	if (!dir.empty() && !boost::filesystem::exists(dir))
+	{
+		if (!boost::filesystem::create_directories(dir))
+		{
+			fmt::print("Unable to create directory {}\n", dir);
+			return false;
+		}
+	}
+
+	if (!theOptions.netcdf4 && (theOptions.deflateLevel > 0 || theOptions.shuffle || theOptions.quantizeDigits > 0))
+	{
+		fmt::print("Compression and quantization need netcdf4 format, ignoring\n");
+	}
+
+	NcFile theOutFile(theFileName.c_str(), NcFile::Replace, nullptr, 0,
+	                  theOptions.netcdf4 ? NcFile::Netcdf4 : NcFile::Classic);
+
+	if (!theOutFile.is_valid())
+	{
+		fmt::print("Unable to create file {}\n", theFileName);
+		return false;
+	}
+
+	// Dimensions
+
+	NcDim *theXDim = 0, *theYDim = 0, *theZDim = 0, *theTDim = 0, *theMDim = 0;
+
+	if (!(theXDim = theOutFile.add_dim(itsXDim->name(), SizeX())))
+	{
+		return false;
+	}
+
+	if (!(theYDim = theOutFile.add_dim(itsYDim->name(), SizeY())))
+	{
+		return false;
+	}
+
+	// Add z dimension if it exists in the original data
+
+	if (itsZDim)
+	{
+		if (!(theZDim = theOutFile.add_dim(itsZDim->name(), static_cast<long>(levels.size()))))
+		{
+			return false;
+		}
+	}
+
+	// Our unlimited dimension
+
+	if (itsTDim)
+	{
+		if (!(theTDim = theOutFile.add_dim(itsTDim->name())))
+		{
+			return false;
+		}
+	}
+
+	// ensemble member dimension
+
+	if (itsMDim)
+	{
+		if (!(theMDim = theOutFile.add_dim(itsMDim->name(), itsMDim->size())))
+		{
+			return false;
+		}
+	}
+
+	// Any other dimensions of the parameters are copied as-is
+
+	for (const NcVar* var : params)
+	{
+		for (int i = 0; i < var->num_dims(); i++)
+		{
+			const NcDim* dim = var->get_dim(i);
+
+			if (dim == itsXDim || dim == itsYDim || dim == itsZDim || dim == itsTDim || dim == itsMDim ||
+			    FindDim(&theOutFile, dim->name()))
+			{
+				continue;
+			}
+
+			if (!theOutFile.add_dim(dim->name(), dim->size()))
+			{
+				return false;
+			}
+		}
+	}
+
+	// Variables
+
+	NcVar *theXVar = 0, *theYVar = 0, *theZVar = 0, *theTVar = 0, *theMVar = 0;
+
+	if (!(theXVar = DefineVar(itsXVar, &theOutFile)))
+	{
+		return false;
 	}
 
-	// z
+	if (!(theYVar = DefineVar(itsYVar, &theOutFile)))
+	{
+		return false;
+	}
 
-	if (itsZDim && itsZVar)
+	if (theZDim && itsZVar)
 	{
 		if (!(theZVar = theOutFile.add_var(theZDim->name(), ncFloat, theZDim)))
 		{
@@ -531,265 +1745,590 @@ bool NFmiNetCDF::WriteSlice(const std::string& theFileName)
 		}
 
 		CopyAtts(theZVar, itsZVar);
+	}
+
+	if (theTDim && itsTVar)
+	{
+		if (!(theTVar = DefineVar(itsTVar, &theOutFile)))
+		{
+			return false;
+		}
+	}
+
+	if (theMDim && itsMVar)
+	{
+		if (!(theMVar = DefineVar(itsMVar, &theOutFile)))
+		{
+			return false;
+		}
+	}
+
+	// Add projection variable if it exists
+
+	NcVar *lon = 0, *lat = 0, *outlon = 0, *outlat = 0;
+
+	if (itsProjectionVar)
+	{
+		if (!DefineVar(itsProjectionVar, &theOutFile))
+		{
+			fmt::print("Unable to copy projection variable {}\n", itsProjectionVar->name());
+			return false;
+		}
+
+		// Check if "longitude" and "latitude" variables exist
+
+		const auto lonit = itsVariableIndex.find("longitude");
+		const auto latit = itsVariableIndex.find("latitude");
+
+		if (itsProjection == "polar_stereographic" && lonit != itsVariableIndex.end() &&
+		    latit != itsVariableIndex.end())
+		{
+			lon = lonit->second;
+			lat = latit->second;
+
+			assert(lon->num_dims() == lat->num_dims());
+
+			if (!(outlon = DefineVar(lon, &theOutFile)) || !(outlat = DefineVar(lat, &theOutFile)))
+			{
+				return false;
+			}
+
+			if (theOptions.netcdf4 && (!DefineStorage(&theOutFile, outlon, lon, theOptions, false) ||
+			                           !DefineStorage(&theOutFile, outlat, lat, theOptions, false)))
+			{
+				return false;
+			}
+		}
+	}
+
+	// Slices of a parameter that are written: parameters without z dimension
+	// have one dummy level
+
+	const auto Slices = [&](const NcVar* var)
+	{
+		const bool hasZ = itsZDim && HasDimension(var, "z");
+		vector<pair<size_t, size_t>> slices;
+
+		for (size_t ti = 0; ti < times.size(); ti++)
+		{
+			for (size_t zi = 0; zi < (hasZ ? levels.size() : 1); zi++)
+			{
+				slices.emplace_back(ti, zi);
+			}
+		}
+
+		return slices;
+	};
+
+	// parameters; dimensions are in the same order as in the source
+
+	vector<NcVar*> outvars;
+	outvars.reserve(params.size());
+
+	// packing of each parameter: (scale_factor, add_offset), or (0, 0) if not packed
+	vector<pair<double, double>> packing(params.size(), {0, 0});
+
+	for (size_t p = 0; p < params.size(); p++)
+	{
+		NcVar* var = params[p];
+		const bool pack = theOptions.packShorts && (var->type() == ncFloat || var->type() == ncDouble);
+
+		if (pack)
+		{
+			// value range of the selected data; this reads the data once more
+
+			double minValue = std::numeric_limits<double>::max();
+			double maxValue = std::numeric_limits<double>::lowest();
+
+			size_t start[NC_MAX_VAR_DIMS], count[NC_MAX_VAR_DIMS];
+			vector<double> values;
+			const DecodeParams params = UnpackParams(*this, var);
+
+			for (const auto& slice : Slices(var))
+			{
+				values.resize(SliceShape(var, times[slice.first], levels.empty() ? 0 : levels[slice.second], start,
+				                         count));
+				ReadSlab(var, start, count, values.data(), values.size(), params);
+
+				for (double v : values)
+				{
+					if (v != kFloatMissing && std::isfinite(v))
+					{
+						minValue = std::min(minValue, v);
+						maxValue = std::max(maxValue, v);
+					}
+				}
+			}
+
+			double scale = 1, offset = 0;
+
+			if (maxValue > minValue)
+			{
+				scale = (maxValue - minValue) / PACKED_RANGE;
+				offset = 0.5 * (maxValue + minValue);
+			}
+			else if (maxValue == minValue)
+			{
+				offset = minValue;
+			}
+
+			// pack with the values readers will see
+
+			if (var->type() == ncFloat)
+			{
+				scale = static_cast<float>(scale);
+				offset = static_cast<float>(offset);
+			}
+
+			if (!(scale > 0))
+			{
+				scale = 1;
+			}
+
+			packing[p] = {scale, offset};
+		}
+
+		NcVar* outvar = DefineVar(var, &theOutFile, pack ? ncShort : ncNoType);
+
+		if (!outvar)
+		{
+			fmt::print("Unable to define variable {}\n", var->name());
+			return false;
+		}
+
+		if (pack)
+		{
+			const bool isFloat = (var->type() == ncFloat);
+			const double scale = packing[p].first, offset = packing[p].second;
+
+			if (!(isFloat ? outvar->add_att("scale_factor", static_cast<float>(scale))
+			              : outvar->add_att("scale_factor", scale)) ||
+			    !(isFloat ? outvar->add_att("add_offset", static_cast<float>(offset))
+			              : outvar->add_att("add_offset", offset)) ||
+			    !outvar->add_att("_FillValue", PACKED_FILL_VALUE))
+			{
+				return false;
+			}
+		}
+
+		if (theOptions.netcdf4)
+		{
+			// no quantization for packed integers
+
+			WriteOptions options = theOptions;
+
+			if (pack)
+			{
+				options.quantizeDigits = 0;
+			}
+
+			if (!DefineStorage(&theOutFile, outvar, var, options, theOptions.chunkSlices))
+			{
+				return false;
+			}
+		}
+
+		outvars.push_back(outvar);
+	}
+
+	// Global attributes
+
+	const auto atts = ReadGlobalAttributes(itsDataFile.get());
+
+	for (const auto& p : atts)
+	{
+		theOutFile.add_att(p.first.c_str(), p.second.c_str());
+	}
+
+	if (!itsConvention.empty())
+	{
+		if (!theOutFile.add_att("Conventions", itsConvention.c_str()))
+		{
+			return false;
+		}
+	}
+
+	time_t now;
+	time(&now);
+
+	string datetime = ctime(&now);
+
+	// ctime adds implicit newline
+
+	datetime.erase(remove(datetime.begin(), datetime.end(), '\n'), datetime.end());
+
+	if (!theOutFile.add_att("file_creation_time", datetime.c_str()))
+	{
+		return false;
+	}
+
+	if (!itsInstitution.empty())
+	{
+		if (!theOutFile.add_att("institution", itsInstitution.c_str()))
+			return false;
+	}
+
+	if (!theOutFile.add_att("distributor", "Finnish Meteorological Institute"))
+		return false;
+
+	// Data
+
+	if (!theOutFile.data_mode())
+	{
+		return false;
+	}
+
+	CopyOptions copyOptions;
+	copyOptions.maxBytes = itsCopyBufferSize;
+	copyOptions.ncid = itsDataFile->id();
+	copyOptions.outNcid = theOutFile.id();
 
+	if (!CopyData(theXVar, itsXVar, nullptr, nullptr, nullptr, copyOptions) ||
+	    !CopyData(theYVar, itsYVar, nullptr, nullptr, nullptr, copyOptions))
+	{
+		return false;
+	}
+
+	if (theZVar)
+	{
 		/*
-		 * Set z value. If current variable has no z dimension, Level() will return
-		 * kFloatMissing. In that case we set level = 0.
+		 * Z values of the selected level indexes from the level axis. WriteSlice()
+		 * selects level index 0 when the current variable has no z dimension, so
+		 * the z value is that of the first level. Level() returns kFloatMissing
+		 * for indexes the axis has no value for; those are written as 0.
 		 */
 
-		auto zValue = Level();
+		vector<float> zValues;
+		zValues.reserve(levels.size());
+
+		for (long z : levels)
+		{
+			const auto zValue = Level(z);
+			zValues.push_back(zValue == kFloatMissing ? 0 : zValue);
+		}
+
+		if (!theZVar->put(zValues.data(), static_cast<long>(zValues.size())))
+			return false;
+	}
+
+	if (theTVar)
+	{
+		vector<double> tValues;
+		tValues.reserve(times.size());
 
-		if (zValue == kFloatMissing)
-			zValue = 0;
+		for (long t : times)
+		{
+			tValues.push_back(Time<double>(t));
+		}
 
-		if (!theZVar->put(&zValue, 1))
+		if (!theTVar->put(tValues.data(), static_cast<long>(tValues.size())))
 			return false;
 	}
 
-	// t
+	if (theMVar && !CopyData(theMVar, itsMVar, nullptr, nullptr, nullptr, copyOptions))
+	{
+		return false;
+	}
+
+	if (outlon && outlat &&
+	    (!CopyData(outlon, lon, nullptr, nullptr, nullptr, copyOptions) ||
+	     !CopyData(outlat, lat, nullptr, nullptr, nullptr, copyOptions)))
+	{
+		return false;
+	}
+
+	// Group selected indexes to runs of consecutive values: each run is
+	// (position in selection, length)
+
+	const auto Runs = [](const vector<long>& indexes)
+	{
+		vector<pair<long, long>> runs;
+
+		for (size_t i = 0; i < indexes.size(); i++)
+		{
+			if (!runs.empty() && indexes[i] == indexes[i - 1] + 1)
+			{
+				runs.back().second++;
+			}
+			else
+			{
+				runs.emplace_back(static_cast<long>(i), 1);
+			}
+		}
 
-	long time_index = TimeIndex();
-	long time_size = 1;
-	if (!CopyVar(&theTVar, itsTVar, &theOutFile, &time_index, &time_size))
-	{
-		return false;
-	}
+		return runs;
+	};
 
-	// ensemble member variable
+	const auto timeRuns = Runs(times);
+	const auto levelRuns = Runs(levels);
 
-	if (itsMDim && theMDim)
+	for (size_t p = 0; p < params.size(); p++)
 	{
-		if (!CopyVar(&theMVar, itsMVar, &theOutFile, nullptr, nullptr))
+		NcVar* var = params[p];
+		const int num_dims = var->num_dims();
+
+		if (packing[p].first != 0)
 		{
-			return false;
+			if (!WritePacked(var, outvars[p], theOutFile.id(), times, levels, Slices(var), packing[p]))
+			{
+				fmt::print("Unable to write data for variable {}\n", var->name());
+				return false;
+			}
+
+			continue;
 		}
-#if 0
-		if (!(theMVar = theOutFile.add_var(itsMDim->name(), ncShort, theMDim)))
-			return false;
 
-		CopyAtts(theMVar, itsMVar);
+		// parameters without z dimension have one dummy level run
 
-		const long sizeM = itsMDim->size();
-		auto mValues = ::Values<short>(itsMVar);
-		if (!theMVar->put(mValues.data(), sizeM))
-		{
-			return false;
-		}
-#endif
-	}
+		const bool hasZ = itsZDim && HasDimension(var, "z");
+		const vector<pair<long, long>> zruns = hasZ ? levelRuns : vector<pair<long, long>>{{0, 1}};
 
-	// Add projection variable if it exists
+		vector<long> cursor_position(num_dims), dimension_length(num_dims), output_position(num_dims);
 
-	if (itsProjectionVar)
-	{
-		NcVar* outprojvar = 0;
-		switch (itsProjectionVar->type())
+		for (const auto& trun : timeRuns)
 		{
-			case ncFloat:
-				if (!(outprojvar = theOutFile.add_var(itsProjectionVar->name(), ncFloat)))
+			for (const auto& zrun : zruns)
+			{
+				for (int i = 0; i < num_dims; i++)
 				{
-					return false;
+					const NcDim* dim = var->get_dim(i);
+
+					if (dim == itsTDim)
+					{
+						cursor_position[i] = times[static_cast<size_t>(trun.first)];
+						dimension_length[i] = trun.second;
+						output_position[i] = trun.first;
+					}
+					else if (hasZ && dim == itsZDim)
+					{
+						cursor_position[i] = levels[static_cast<size_t>(zrun.first)];
+						dimension_length[i] = zrun.second;
+						output_position[i] = zrun.first;
+					}
+					else
+					{
+						cursor_position[i] = 0;
+						dimension_length[i] = dim->size();
+						output_position[i] = 0;
+					}
 				}
-				break;
 
-			case ncDouble:
-				if (!(outprojvar = theOutFile.add_var(itsProjectionVar->name(), ncDouble)))
+				if (!CopyData(outvars[p], var, cursor_position.data(), dimension_length.data(),
+				              output_position.data(), copyOptions))
 				{
+					fmt::print("Unable to write data for variable {}\n", var->name());
 					return false;
 				}
-				break;
+			}
+		}
+	}
 
-			case ncShort:
-				if (!(outprojvar = theOutFile.add_var(itsProjectionVar->name(), ncShort)))
-				{
-					return false;
-				}
-				break;
+	theOutFile.sync();
+	theOutFile.close();
 
-			case ncInt:
-				if (!(outprojvar = theOutFile.add_var(itsProjectionVar->name(), ncInt)))
-				{
-					return false;
-				}
-				break;
-			case ncChar:
-				if (!(outprojvar = theOutFile.add_var(itsProjectionVar->name(), ncChar)))
-				{
-					return false;
-				}
-				break;
-			case ncByte:
-				if (!(outprojvar = theOutFile.add_var(itsProjectionVar->name(), ncByte)))
-				{
-					return false;
-				}
-				break;
+	return true;
+}
 
-			case ncNoType:
-			default:
-				fmt::print("NcType {} is not supported for variable {}\n", fmt::underlying(itsProjectionVar->type()),
-				           itsProjectionVar->name());
-				break;
-		}
-		CopyAtts(outprojvar, itsProjectionVar);
+/*
+ * WritePacked()
+ *
+ * Write selected slices of var to outvar as shorts packed with (scale_factor,
+ * add_offset). Missing values are written as the fill value. Slices are
+ * (time, level) positions in the output file.
+ */
 
-		// Check if "longitude" and "latitude" variables exist
-		NcVar* lon = itsDataFile->get_var("longitude");
-		NcVar* lat = itsDataFile->get_var("latitude");
+bool NFmiNetCDF::WritePacked(const NcVar* var, NcVar* outvar, int outNcid, const vector<long>& times,
+                             const vector<long>& levels, const vector<pair<size_t, size_t>>& slices,
+                             const pair<double, double>& packing)
+{
+	const double scale = packing.first;
+	const double offset = packing.second;
+	const int num_dims = var->num_dims();
 
-		if (itsProjection == "polar_stereographic" && lon && lat)
-		{
-			NcVar *outlon = 0, *outlat = 0;
+	size_t start[NC_MAX_VAR_DIMS], count[NC_MAX_VAR_DIMS], outstart[NC_MAX_VAR_DIMS];
 
-			// get dims
-			vector<NcDim*> dims;
-			assert(lon->num_dims() == lat->num_dims());
-			vector<long> cursors;
+	vector<double> values;
+	vector<short> packed;
 
-			for (int i = 0; i < lon->num_dims(); i++)
-			{
-				auto dim = lon->get_dim(i);
-				assert(dim);
+	const DecodeParams params = UnpackParams(*this, var);
 
-				if (static_cast<string>(dim->name()) == static_cast<string>(theXDim->name()))
-				{
-					dims.push_back(theXDim);
-					cursors.push_back(itsXVar->num_vals());
-				}
-				else if (static_cast<string>(dim->name()) == static_cast<string>(theYDim->name()))
-				{
-					dims.push_back(theYDim);
-					cursors.push_back(itsYVar->num_vals());
-				}
-			}
+	for (const auto& slice : slices)
+	{
+		const size_t N =
+		    SliceShape(var, times[slice.first], levels.empty() ? 0 : levels[slice.second], start, count);
+
+		values.resize(N);
+		packed.resize(N);
 
-			assert(lon->num_dims() == static_cast<int>(dims.size()));
+		if (!ReadSlab(var, start, count, values.data(), N, params))
+		{
+			return false;
+		}
 
-			outlon = theOutFile.add_var(lon->name(), ncFloat, static_cast<int>(dims.size()),
-			                            const_cast<const NcDim**>(&dims[0]));
-			outlat = theOutFile.add_var(lat->name(), ncFloat, static_cast<int>(dims.size()),
-			                            const_cast<const NcDim**>(&dims[0]));
+		for (size_t i = 0; i < N; i++)
+		{
+			const double v = values[i];
 
-			assert(outlon);
-			assert(outlat);
+			if (v == kFloatMissing || !std::isfinite(v))
+			{
+				packed[i] = PACKED_FILL_VALUE;
+			}
+			else
+			{
+				const double p = std::round((v - offset) / scale);
+				packed[i] = static_cast<short>(std::min(std::max(p, -PACKED_RANGE / 2), PACKED_RANGE / 2));
+			}
+		}
 
-			CopyAtts(outlon, lon);
-			CopyAtts(outlat, lat);
+		for (int i = 0; i < num_dims; i++)
+		{
+			const NcDim* dim = var->get_dim(i);
 
-			// copy data
-			size_t totalSize = 1;
-			for (size_t i = 0; i < cursors.size(); i++)
-				totalSize *= cursors[i];
+			if (itsTDim && dim == itsTDim)
+			{
+				outstart[i] = slice.first;
+			}
+			else if (itsZDim && dim == itsZDim)
+			{
+				outstart[i] = slice.second;
+			}
+			else
+			{
+				outstart[i] = start[i];
+			}
+		}
 
-			vector<float> vals(totalSize);
-			lon->get(&vals[0], &cursors[0]);
-			outlon->put(&vals[0], itsYVar->num_vals(), itsXVar->num_vals());
+		const int ret = nc_put_vara_short(outNcid, outvar->id(), outstart, count, packed.data());
 
-			lat->get(&vals[0], &cursors[0]);
-			outlat->put(&vals[0], &cursors[0]);
+		if (ret != NC_NOERR)
+		{
+			fmt::print("Writing variable {} failed: {}\n", outvar->name(), nc_strerror(ret));
+			return false;
 		}
 	}
 
-	// parameter
+	return true;
+}
 
-	// Add dimensions to parameter. Note! Order must be the same!
+/*
+ * DefineStorage()
+ *
+ * Set netcdf4 chunking, compression and quantization of an output variable.
+ * Must be called in define mode, before any data is written to the variable.
+ */
 
-	NcVar* var = Param();
-	int num_dims = var->num_dims();
+bool NFmiNetCDF::DefineStorage(NcFile* theOutFile, NcVar* newvar, const NcVar* oldvar, const WriteOptions& theOptions,
+                               bool chunkSlices) const
+{
+	const int ncid = theOutFile->id();
+	const int varid = newvar->id();
+	const int ndims = oldvar->num_dims();
 
-	vector<NcDim*> dims(num_dims);
-	vector<long> cursor_position(num_dims), dimension_length(num_dims);
+	int ret = NC_NOERR;
 
-	for (int i = 0; i < num_dims; i++)
+	if (chunkSlices && ndims > 0)
 	{
-		string dimname = var->get_dim(i)->name();
+		// one chunk per (y, x) slice
 
-		if (dimname == itsTDim->name())
-		{
-			dims[i] = theTDim;
-			cursor_position[i] = TimeIndex();
-			dimension_length[i] = 1;
-		}
-		else if (theZDim && dimname == itsZDim->name())
-		{
-			dims[i] = theZDim;
-			cursor_position[i] = LevelIndex();
-			dimension_length[i] = 1;
-		}
-		else if (dimname == itsXDim->name())
-		{
-			dims[i] = theXDim;
-			cursor_position[i] = 0;
-			dimension_length[i] = itsXDim->size();
-		}
-		else if (dimname == itsYDim->name())
+		size_t chunks[NC_MAX_VAR_DIMS];
+
+		for (int i = 0; i < ndims; i++)
 		{
-			dims[i] = theYDim;
-			cursor_position[i] = 0;
-			dimension_length[i] = itsYDim->size();
+			const NcDim* dim = oldvar->get_dim(i);
+			chunks[i] = (dim == itsXDim || dim == itsYDim) ? static_cast<size_t>(dim->size()) : 1;
 		}
-		else if (theMDim && dimname == itsMDim->name())
+
+		if ((ret = nc_def_var_chunking(ncid, varid, NC_CHUNKED, chunks)) != NC_NOERR)
 		{
-			dims[i] = theMDim;
-			cursor_position[i] = 1;
-			dimension_length[i] = 1;
+			fmt::print("Unable to set chunking for {}: {}\n", newvar->name(), nc_strerror(ret));
+			return false;
 		}
 	}
 
-	CopyVar(&outvar, var, &theOutFile, cursor_position.data(), dimension_length.data());
-
-	// Global attributes
-
-	const auto atts = ReadGlobalAttributes(itsDataFile.get());
-
-	for (const auto& p : atts)
+	if (theOptions.deflateLevel > 0 || theOptions.shuffle)
 	{
-		theOutFile.add_att(p.first.c_str(), p.second.c_str());
+		const int level = std::min(std::max(theOptions.deflateLevel, 0), 9);
+
+		if ((ret = nc_def_var_deflate(ncid, varid, theOptions.shuffle ? 1 : 0, level > 0 ? 1 : 0, level)) != NC_NOERR)
+		{
+			fmt::print("Unable to set compression for {}: {}\n", newvar->name(), nc_strerror(ret));
+			return false;
+		}
 	}
 
-	if (!itsConvention.empty())
+	if (theOptions.quantizeDigits > 0 && (oldvar->type() == ncFloat || oldvar->type() == ncDouble))
 	{
-		if (!theOutFile.add_att("Conventions", itsConvention.c_str()))
+#ifdef NC_QUANTIZE_BITGROOM
+		if ((ret = nc_def_var_quantize(ncid, varid, NC_QUANTIZE_BITGROOM, theOptions.quantizeDigits)) != NC_NOERR)
 		{
+			fmt::print("Unable to set quantization for {}: {}\n", newvar->name(), nc_strerror(ret));
 			return false;
 		}
+#else
+		fmt::print("netcdf library does not support quantization, writing {} without it\n", newvar->name());
+#endif
 	}
 
-	time_t now;
-	time(&now);
+	return true;
+}
 
-	string datetime = ctime(&now);
+const NFmiNetCDF::WriteOptions& NFmiNetCDF::GetWriteOptions() const
+{
+	return itsWriteOptions;
+}
+void NFmiNetCDF::SetWriteOptions(const WriteOptions& theOptions)
+{
+	itsWriteOptions = theOptions;
+}
 
-	// ctime adds implicit newline
+size_t NFmiNetCDF::CopyBufferSize() const
+{
+	return itsCopyBufferSize;
+}
+void NFmiNetCDF::CopyBufferSize(size_t theSize)
+{
+	itsCopyBufferSize = theSize;
+}
 
-	datetime.erase(remove(datetime.begin(), datetime.end(), '\n'), datetime.end());
+void NFmiNetCDF::ChunkCache(size_t theSize, size_t theSlots, float thePreemption)
+{
+	itsChunkCacheSize = theSize;
+	itsChunkCacheSlots = theSlots;
+	itsChunkCachePreemption = thePreemption;
 
-	if (!theOutFile.add_att("file_creation_time", datetime.c_str()))
+	if (itsDataFile && itsDataFile->is_valid())
 	{
-		return false;
+		lock_guard<recursive_mutex> lock(netcdfMutex);
+		SetChunkCache();
 	}
+}
 
-	if (!itsInstitution.empty())
+void NFmiNetCDF::SetChunkCache()
+{
+	if (itsChunkCacheSize == 0)
 	{
-		if (!theOutFile.add_att("institution", itsInstitution.c_str()))
-			return false;
+		return;
 	}
 
-	if (!theOutFile.add_att("distributor", "Finnish Meteorological Institute"))
-		return false;
+	int format = 0;
 
-	theOutFile.sync();
-	theOutFile.close();
+	if (nc_inq_format(itsDataFile->id(), &format) != NC_NOERR ||
+	    (format != NC_FORMAT_NETCDF4 && format != NC_FORMAT_NETCDF4_CLASSIC))
+	{
+		return;
+	}
 
-	return true;
-}
+	for (const NcVar* var : itsParameters)
+	{
+		const int ret = nc_set_var_chunk_cache(itsDataFile->id(), var->id(), itsChunkCacheSize, itsChunkCacheSlots,
+		                                       itsChunkCachePreemption);
 
-/*
- * If itsXFlip is set, when writing slice to NetCDF of CSV file the values of X axis
- * are flipped, ie. from 1 2 3 we have 3 2 1.
- *
- * Same applies for Y axis.
- */
+		if (ret != NC_NOERR)
+		{
+			fmt::print("Setting chunk cache for variable {} failed: {}\n", var->name(), nc_strerror(ret));
+		}
+	}
+}
 
 bool NFmiNetCDF::FlipX()
 {
@@ -807,31 +2346,95 @@ void NFmiNetCDF::FlipY(bool theYFlip)
 {
 	itsYFlip = theYFlip;
 }
+bool NFmiNetCDF::ForceRowMajor() const
+{
+	return itsForceRowMajor;
+}
+void NFmiNetCDF::ForceRowMajor(bool theForceRowMajor)
+{
+	itsForceRowMajor = theForceRowMajor;
+}
 
-double Resolution(NcVar* var, long size)
+bool NFmiNetCDF::Unpack() const
 {
-	float a = var->as_float(0);
-	float b = var->as_float(size - 1);
+	return itsUnpack;
+}
+void NFmiNetCDF::Unpack(bool theUnpack)
+{
+	itsUnpack = theUnpack;
+}
+
+size_t NFmiNetCDF::MemoryUsage() const
+{
+	size_t bytes = sizeof(NFmiNetCDF);
+
+	bytes += itsTimes.capacity() * sizeof(double);
+	bytes += itsLevels.capacity() * sizeof(float);
+	bytes += itsSortedLevels.capacity() * sizeof(pair<float, long>);
+	bytes += (itsLongitudes.capacity() + itsLatitudes.capacity()) * sizeof(double);
+
+	for (const auto& atts : itsAttributes)
+	{
+		for (const auto& att : atts)
+		{
+			bytes += sizeof(att) + att.first.capacity() + att.second.text.capacity() +
+			         att.second.values.capacity() * sizeof(double);
+		}
+	}
+
+	// parameter and variable indexes
+	bytes += (itsParameterIndex.size() + itsVariableIndex.size()) * (sizeof(string) + sizeof(NcVar*) + 32);
+
+	return bytes;
+}
+
+NFmiSliceCache* NFmiNetCDF::SliceCache() const
+{
+	return itsSliceCache;
+}
+void NFmiNetCDF::SliceCache(NFmiSliceCache* theCache)
+{
+	itsSliceCache = theCache;
+}
+
+std::recursive_mutex& NFmiNetCDF::LibraryMutex()
+{
+	return netcdfMutex;
+}
+
+const std::string& NFmiNetCDF::MetadataCache() const
+{
+	return itsMetadataCache;
+}
+void NFmiNetCDF::MetadataCache(const std::string& theDirectory)
+{
+	itsMetadataCache = theDirectory;
+}
+
+double Resolution(int ncid, NcVar* var, long size, const NFmiNetCDF::Attribute* missing, const std::string& units)
+{
+	const auto at = [&](long i) { return static_cast<float>(ValueAt(ncid, var, i)); };
+
+	float a = at(0);
+	float b = at(size - 1);
 	long range = size;
 	float delta;
 
-	const std::string missing = NFmiNetCDF::Att(var, "missing_value");
-
-	if (missing.empty() == false && (a == std::stod(missing) || b == std::stod(missing)))
+	if (missing && missing->values.empty() == false && (a == missing->values[0] || b == missing->values[0]))
 	{
 		// case nemo
 		// only sea points have latitude and longitude defined
 		int i = -1;
-		float fmissing = std::stof(missing);
+		const float fmissing = static_cast<float>(missing->values[0]);
 
 		do
 		{
-			a = var->as_float(++i);
+			a = at(++i);
 		} while (a == fmissing && i < range * 2);
 
 		do
 		{
-			b = var->as_float(++i);
+			b = at(++i);
 		} while ((b == fmissing || a == b) && i < range * 3);
 
 		if (a == fmissing || b == fmissing)
@@ -847,7 +2450,6 @@ double Resolution(NcVar* var, long size)
 		delta = fabs(b - a);
 	}
 
-	string units = NFmiNetCDF::Att(var, "units");
 	if (!units.empty())
 	{
 		if (units == "100  km")
@@ -870,7 +2472,7 @@ double Resolution(NcVar* var, long size)
 	int cnt = (var->num_vals() < 10) ? var->num_vals() : 10;
 	for (int i = 0; i < cnt; i++)
 	{
-		int _n = NumberOfDecimalDigits(std::to_string(var->as_float(i)));
+		int _n = NumberOfDecimalDigits(at(i));
 
 		num_digits = (_n > num_digits) ? _n : num_digits;
 	}
@@ -880,16 +2482,85 @@ double Resolution(NcVar* var, long size)
 
 double NFmiNetCDF::XResolution()
 {
-	return Resolution(itsXVar, SizeX());
+	if (!itsValidated)
+	{
+		Validate();
+	}
+
+	if (!itsXResolutionCached)
+	{
+		lock_guard<recursive_mutex> lock(netcdfMutex);
+		itsXResolution = Resolution(itsDataFile->id(), itsXVar, SizeX(), GetAtt(itsXVar, "missing_value"),
+		                             AttText(itsXVar, "units"));
+		itsXResolutionCached = true;
+	}
+
+	return itsXResolution;
 }
 
 double NFmiNetCDF::YResolution()
 {
-	return Resolution(itsYVar, SizeY());
+	if (!itsValidated)
+	{
+		Validate();
+	}
+
+	if (!itsYResolutionCached)
+	{
+		lock_guard<recursive_mutex> lock(netcdfMutex);
+		itsYResolution = Resolution(itsDataFile->id(), itsYVar, SizeY(), GetAtt(itsYVar, "missing_value"),
+		                             AttText(itsYVar, "units"));
+		itsYResolutionCached = true;
+	}
+
+	return itsYResolution;
+}
+
+// Warnings of uneven coordinates are printed once per process, also when
+// drift comes from a metadata sidecar
+
+void WarnResolutionDrift(float xDrift, float yDrift)
+{
+	if (xDrift > 0.0f && xCoordinateWarning.exchange(false))
+	{
+		fmt::print("Warning: X dimension resolution is not constant: {}\n", xDrift);
+	}
+
+	if (yDrift > 0.0f && yCoordinateWarning.exchange(false))
+	{
+		fmt::print("Warning: Y dimension resolution is not constant: {}\n", yDrift);
+	}
+}
+
+bool NFmiNetCDF::Validate()
+{
+	if (itsValidated)
+	{
+		return (itsXResolutionDrift == 0.0f && itsYResolutionDrift == 0.0f);
+	}
+
+	// Drift does not depend on the direction of the axis, so flipping
+	// is not taken into account here
+
+	lock_guard<recursive_mutex> lock(netcdfMutex);
+
+	const auto x = ::Values<float>(itsDataFile->id(), itsXVar);
+	itsXResolutionDrift = (x.size() > 1) ? ResolutionDrift(x) : 0.0f;
+
+	const auto y = ::Values<float>(itsDataFile->id(), itsYVar);
+	itsYResolutionDrift = (y.size() > 1) ? ResolutionDrift(y) : 0.0f;
+
+	WarnResolutionDrift(itsXResolutionDrift, itsYResolutionDrift);
+
+	itsValidated = true;
+
+	return (itsXResolutionDrift == 0.0f && itsYResolutionDrift == 0.0f);
 }
 
 bool NFmiNetCDF::CoordinatesInRowMajorOrder(const NcVar* var)
 {
+	lock_guard<recursive_mutex> lock(netcdfMutex);
+
 	int num_dims = var->num_dims();
 
 	int xCoordNum = -1, yCoordNum = -1;
@@ -914,13 +2585,68 @@ bool NFmiNetCDF::CoordinatesInRowMajorOrder(const NcVar* var)
 	return (xCoordNum > yCoordNum);
 }
 
-bool NFmiNetCDF::HasDimension(const std::string& dimName)
+bool NFmiNetCDF::HasDimension(const std::string& dimName)
+{
+	lock_guard<recursive_mutex> lock(netcdfMutex);
+	return HasDimension(Param(), dimName);
+}
+std::string NFmiNetCDF::Att(const std::string& attName)
+{
+	const Attribute* att = GetAtt(Param(), attName);
+
+	if (!att)
+		return "";
+
+	if (att->type == ncChar)
+		return att->text;
+
+	if (att->values.empty())
+		return "";
+
+	// same formatting as in static Att()
+
+	const double val = att->values[0];
+
+	switch (att->type)
+	{
+		case ncFloat:
+			return std::to_string(static_cast<float>(val));
+		case ncDouble:
+			return std::to_string(val);
+		case ncByte:
+		case ncShort:
+		case ncInt:
+			return std::to_string(static_cast<int>(val));
+		default:
+			return "";
+	}
+}
+
+const NFmiNetCDF::Attribute* NFmiNetCDF::GetAtt(const NcVar* var, const std::string& attName) const
+{
+	assert(var);
+
+	const auto id = static_cast<size_t>(var->id());
+
+	if (id >= itsAttributes.size())
+		return nullptr;
+
+	const auto& atts = itsAttributes[id];
+	const auto it = atts.find(attName);
+
+	return (it == atts.end()) ? nullptr : &it->second;
+}
+
+std::string NFmiNetCDF::AttText(const NcVar* var, const std::string& attName) const
 {
-	return HasDimension(Param(), dimName);
+	const Attribute* att = GetAtt(var, attName);
+	return (att && att->type == ncChar) ? att->text : "";
 }
-std::string NFmiNetCDF::Att(const std::string& attName)
+
+double NFmiNetCDF::AttValue(const NcVar* var, const std::string& attName, double defaultValue) const
 {
-	return NFmiNetCDF::Att(Param(), attName);
+	const Attribute* att = GetAtt(var, attName);
+	return (att && !att->values.empty()) ? att->values[0] : defaultValue;
 }
 
 // private functions
@@ -956,6 +2682,8 @@ std::string NFmiNetCDF::Att(NcVar* var, const std::string& attName)
 	string ret("");
 	assert(var);
 
+	lock_guard<recursive_mutex> lock(netcdfMutex);
+
 	for (unsigned short i = 0; i < var->num_atts(); i++)
 	{
 		auto att = unique_ptr<NcAtt>(var->get_att(i));
@@ -993,41 +2721,328 @@ std::string NFmiNetCDF::Att(NcVar* var, const std::string& attName)
 	return ret;
 }
 
-template <typename T>
-vector<T> NFmiNetCDF::Values(NcVar* var, long timeIndex, long levelIndex)
+size_t NFmiNetCDF::SliceShape(const NcVar* var, long timeIndex, long levelIndex, size_t* cursor_position,
+                              size_t* dimsizes, long timeCount, long levelCount, const IndexWindow* window) const
 {
-	int num_dims = static_cast<size_t>(var->num_dims());
+	const auto& dims = itsVariableDims[static_cast<size_t>(var->id())];
 
-	vector<long> cursor_position(num_dims), dimsizes(num_dims);
+	size_t size = 1;
 
-	for (int i = 0; i < num_dims; i++)
+	for (size_t i = 0; i < dims.size(); i++)
 	{
-		NcDim* dim = var->get_dim(i);
-		string dimname = static_cast<string>(dim->name());
+		const int dim = dims[i];
 
 		long index = 0;
-		long dimsize = dim->size();
+		long dimsize = itsDimSizes[static_cast<size_t>(dim)];
 
-		if (itsTDim && dimname == itsTDim->name())
+		if (itsTDim && dim == itsTDim->id())
 		{
 			index = timeIndex;
-			dimsize = 1;
+			dimsize = timeCount;
 		}
-		else if (levelIndex != -1 && itsZDim && dimname == itsZDim->name())
+		else if (levelIndex != -1 && itsZDim && dim == itsZDim->id())
 		{
 			index = levelIndex;
-			dimsize = 1;  // XXX METAN has dimsize == 2, (y, x)
+			dimsize = levelCount;  // XXX METAN has dimsize == 2, (y, x)
+		}
+		else if (window && itsXDim && dim == itsXDim->id())
+		{
+			index = window->x0;
+			dimsize = window->nx;
+		}
+		else if (window && itsYDim && dim == itsYDim->id())
+		{
+			index = window->y0;
+			dimsize = window->ny;
+		}
+
+		cursor_position[i] = static_cast<size_t>(index);
+		dimsizes[i] = static_cast<size_t>(dimsize);
+		size *= dimsizes[i];
+	}
+
+	return size;
+}
+
+template <typename T>
+bool NFmiNetCDF::Values(NcVar* var, long timeIndex, long levelIndex, T* theBuffer, size_t theSize, long timeCount,
+                        long levelCount, const IndexWindow* window)
+{
+	if (!itsSliceCache || timeCount != 1 || levelCount != 1 || window)
+	{
+		return ReadSlice(var, timeIndex, levelIndex, theBuffer, theSize, timeCount, levelCount, window);
+	}
+
+	const string key = SliceKey(var, timeIndex, levelIndex, sizeof(T));
+	const auto cached = itsSliceCache->Find<T>(key);
+
+	if (cached && cached->size() <= theSize)
+	{
+		std::copy(cached->begin(), cached->end(), theBuffer);
+		return true;
+	}
+
+	if (!ReadSlice(var, timeIndex, levelIndex, theBuffer, theSize, 1, 1, nullptr))
+	{
+		return false;
+	}
+
+	size_t cursor_position[NC_MAX_VAR_DIMS], dimsizes[NC_MAX_VAR_DIMS];
+	const size_t N = SliceShape(var, timeIndex, levelIndex, cursor_position, dimsizes);
+
+	itsSliceCache->Insert<T>(key, make_shared<const vector<T>>(theBuffer, theBuffer + N));
+
+	return true;
+}
+
+template bool NFmiNetCDF::Values(NcVar*, long, long, float*, size_t, long, long, const IndexWindow*);
+template bool NFmiNetCDF::Values(NcVar*, long, long, double*, size_t, long, long, const IndexWindow*);
+
+template <typename T>
+bool NFmiNetCDF::ReadSlice(NcVar* var, long timeIndex, long levelIndex, T* theBuffer, size_t theSize, long timeCount,
+                           long levelCount, const IndexWindow* window)
+{
+	size_t cursor_position[NC_MAX_VAR_DIMS], dimsizes[NC_MAX_VAR_DIMS];
+
+	const size_t N =
+	    SliceShape(var, timeIndex, levelIndex, cursor_position, dimsizes, timeCount, levelCount, window);
+
+	if (theSize < N)
+	{
+		fmt::print("Buffer too small for variable {}: {} < {}\n", var->name(), theSize, N);
+		return false;
+	}
+
+	const DecodeParams params = itsUnpack ? UnpackParams(*this, var) : DecodeParams();
+
+	if (!ReadSlab(var, cursor_position, dimsizes, theBuffer, N, params))
+	{
+		return false;
+	}
+
+	const size_t nx = static_cast<size_t>(window ? window->nx : DimSize(itsXDim));
+	const size_t ny = static_cast<size_t>(window ? window->ny : DimSize(itsYDim));
+
+	Orient(var, theBuffer, N, nx, ny);
+
+	return true;
+}
+
+template bool NFmiNetCDF::ReadSlice(NcVar*, long, long, float*, size_t, long, long, const IndexWindow*);
+template bool NFmiNetCDF::ReadSlice(NcVar*, long, long, double*, size_t, long, long, const IndexWindow*);
+
+// Options that change the values read are part of the key, so instances with
+// different settings can share a cache
+
+std::string NFmiNetCDF::SliceKey(const NcVar* var, long timeIndex, long levelIndex, size_t typeSize)
+{
+	if (itsFileKey.empty())
+	{
+		string path;
+		uint64_t size;
+		int64_t mtime;
+
+		itsFileKey = FileIdentity(itsFileName, path, size, mtime) ? fmt::format("{}:{}:{}", path, size, mtime)
+		                                                          : itsFileName;
+	}
+
+	return fmt::format("{}|{}|{}|{}|{}|{:d}{:d}{:d}{:d}", itsFileKey, var->name(), timeIndex, levelIndex, typeSize,
+	                   itsUnpack, itsXFlip, itsYFlip, itsForceRowMajor);
+}
+
+template <typename T>
+shared_ptr<const vector<T>> NFmiNetCDF::SharedValues(const std::string& theParameter)
+{
+	NcVar* var = FindParameter(theParameter);
+
+	if (!var)
+	{
+		return nullptr;
+	}
+
+	string key;
+
+	if (itsSliceCache)
+	{
+		key = SliceKey(var, TimeIndex(), LevelIndex(), sizeof(T));
+
+		auto cached = itsSliceCache->Find<T>(key);
+
+		if (cached)
+		{
+			return cached;
+		}
+	}
+
+	size_t cursor_position[NC_MAX_VAR_DIMS], dimsizes[NC_MAX_VAR_DIMS];
+	auto values = make_shared<vector<T>>(SliceShape(var, TimeIndex(), LevelIndex(), cursor_position, dimsizes));
+
+	if (!ReadSlice(var, TimeIndex(), LevelIndex(), values->data(), values->size(), 1, 1, nullptr))
+	{
+		return nullptr;
+	}
+
+	shared_ptr<const vector<T>> ret = std::move(values);
+
+	if (itsSliceCache)
+	{
+		itsSliceCache->Insert<T>(key, ret);
+	}
+
+	return ret;
+}
+
+template shared_ptr<const vector<float>> NFmiNetCDF::SharedValues(const std::string&);
+template shared_ptr<const vector<double>> NFmiNetCDF::SharedValues(const std::string&);
+
+/*
+ * Orient()
+ *
+ * Apply FlipX, FlipY and ForceRowMajor to values read from var. Buffer holds
+ * consecutive (y, x) or (x, y) slices of nx * ny values; variables where x and y
+ * are not the two innermost dimensions are left as is.
+ */
+
+template <typename T>
+void NFmiNetCDF::Orient(const NcVar* var, T* theBuffer, size_t theSize, size_t nx, size_t ny) const
+{
+	if (!itsXFlip && !itsYFlip && !itsForceRowMajor)
+	{
+		return;
+	}
+
+	const auto& dims = itsVariableDims[static_cast<size_t>(var->id())];
+
+	if (dims.size() < 2 || !itsXDim || !itsYDim)
+	{
+		return;
+	}
+
+	const int outer = dims[dims.size() - 2];
+	const int inner = dims[dims.size() - 1];
+
+	bool rowMajor;
+
+	if (outer == itsYDim->id() && inner == itsXDim->id())
+	{
+		rowMajor = true;
+	}
+	else if (outer == itsXDim->id() && inner == itsYDim->id())
+	{
+		rowMajor = false;
+	}
+	else
+	{
+		return;
+	}
+
+	const size_t sliceSize = nx * ny;
+
+	if (sliceSize == 0)
+	{
+		return;
+	}
+
+	// rows and columns of the slice in memory, and the flips in those terms
+
+	size_t rows = ny, cols = nx;
+	bool flipRows = itsXFlip, flipColumns = itsYFlip;
+
+	if (!rowMajor && !itsForceRowMajor)
+	{
+		std::swap(rows, cols);
+		std::swap(flipRows, flipColumns);
+	}
+
+	vector<T> scratch;
+
+	for (size_t offset = 0; offset + sliceSize <= theSize; offset += sliceSize)
+	{
+		T* slice = theBuffer + offset;
+
+		if (!rowMajor && itsForceRowMajor)
+		{
+			TransposeSlice(slice, nx, ny, scratch);
+		}
+
+		FlipSlice(slice, rows, cols, flipRows, flipColumns);
+	}
+}
+
+template void NFmiNetCDF::Orient(const NcVar*, float*, size_t, size_t, size_t) const;
+template void NFmiNetCDF::Orient(const NcVar*, double*, size_t, size_t, size_t) const;
+
+template <typename T>
+bool NFmiNetCDF::ReadSlab(const NcVar* var, const size_t* start, const size_t* count, T* theBuffer, size_t theSize,
+                          const DecodeParams& theParams)
+{
+	// memory mapped classic files are decoded and unpacked in one pass; that
+	// does not touch the library, so it is the only read done without the
+	// library mutex
+
+	if (itsClassicFile && itsClassicFile->Read(var->id(), start, count, theBuffer, theParams))
+	{
+		return true;
+	}
+
+	const int ncid = itsDataFile->id();
+	const int varid = var->id();
+
+	int ret;
+
+	if (theParams.fillCount == 0 && theParams.scale == 1 && theParams.offset == 0)
+	{
+		lock_guard<recursive_mutex> lock(netcdfMutex);
+		ret = GetVara(ncid, varid, start, count, theBuffer);
+	}
+	else
+	{
+		// Values are read in the stored type and decoded like from a memory
+		// mapping, so that fill values are compared in the stored type on both
+		// paths. The library would convert them to T first.
+
+		nc_type type = NC_NAT;
+		size_t width = 0;
+		vector<unsigned char> raw;
+
+		{
+			lock_guard<recursive_mutex> lock(netcdfMutex);
+
+			if ((ret = nc_inq_vartype(ncid, varid, &type)) == NC_NOERR &&
+			    (ret = nc_inq_type(ncid, type, nullptr, &width)) == NC_NOERR)
+			{
+				raw.resize(theSize * width);
+				ret = nc_get_vara(ncid, varid, start, count, raw.data());
+			}
+		}
+
+		if (ret == NC_NOERR && !DecodeNative(raw.data(), type, theSize, theBuffer, theParams))
+		{
+			// only doubles can be out of range for T
+			ret = (type == NC_DOUBLE) ? NC_ERANGE : NC_EBADTYPE;
 		}
+	}
 
-		cursor_position[i] = index;
-		dimsizes[i] = dimsize;
+	if (ret != NC_NOERR)
+	{
+		fmt::print("Reading variable {} failed: {}\n", var->name(), nc_strerror(ret));
+		std::fill(theBuffer, theBuffer + theSize, static_cast<T>(kFloatMissing));
+		return false;
 	}
 
-	var->set_cur(&cursor_position[0]);
+	return true;
+}
+
+template bool NFmiNetCDF::ReadSlab(const NcVar*, const size_t*, const size_t*, float*, size_t, const DecodeParams&);
+template bool NFmiNetCDF::ReadSlab(const NcVar*, const size_t*, const size_t*, double*, size_t, const DecodeParams&);
+
+template <typename T>
+vector<T> NFmiNetCDF::Values(NcVar* var, long timeIndex, long levelIndex)
+{
+	size_t cursor_position[NC_MAX_VAR_DIMS], dimsizes[NC_MAX_VAR_DIMS];
 
-	size_t dims = std::accumulate(dimsizes.begin(), dimsizes.end(), 1, [](long a, long b) { return a * b; });
-	vector<T> values(dims, static_cast<T>(kFloatMissing));
-	var->get(values.data(), dimsizes.data());
+	vector<T> values(SliceShape(var, timeIndex, levelIndex, cursor_position, dimsizes));
+	Values<T>(var, timeIndex, levelIndex, values.data(), values.size());
 
 	return values;
 }
@@ -1035,6 +3050,118 @@ vector<T> NFmiNetCDF::Values(NcVar* var, long timeIndex, long levelIndex)
 template vector<float> NFmiNetCDF::Values(NcVar*, long, long);
 template vector<double> NFmiNetCDF::Values(NcVar*, long, long);
 
+void NFmiNetCDF::CacheAttributes(const NcVar* var)
+{
+	const int ncid = itsDataFile->id();
+	const int varid = var->id();
+
+	auto& atts = itsAttributes[static_cast<size_t>(varid)];
+	atts.clear();
+
+	int natts = 0;
+	nc_inq_varnatts(ncid, varid, &natts);
+
+	char name[NC_MAX_NAME + 1];
+
+	for (int i = 0; i < natts; i++)
+	{
+		size_t len = 0;
+		Attribute a;
+
+		if (nc_inq_attname(ncid, varid, i, name) != NC_NOERR ||
+		    nc_inq_att(ncid, varid, name, &a.type, &len) != NC_NOERR)
+		{
+			continue;
+		}
+
+		if (a.type == NC_CHAR)
+		{
+			// text attributes are not necessarily null terminated, and
+			// may contain trailing nulls
+
+			a.text.resize(len);
+
+			if (len > 0 && nc_get_att_text(ncid, varid, name, &a.text[0]) == NC_NOERR)
+			{
+				a.text.resize(strlen(a.text.c_str()));
+			}
+			else
+			{
+				a.text.clear();
+			}
+		}
+		else
+		{
+			a.values.resize(len);
+
+			if (len > 0 && nc_get_att_double(ncid, varid, name, a.values.data()) != NC_NOERR)
+			{
+				a.values.clear();
+			}
+		}
+
+		atts.emplace(name, std::move(a));
+	}
+}
+
+// Data reads do not call NcVar::num_dims(), NcVar::get_dim() or NcDim::size():
+// those query the library, and reads of classic files are not serialized
+
+bool NFmiNetCDF::CacheShapes()
+{
+	const int ncid = itsDataFile->id();
+
+	int ndims = 0, nvars = 0;
+
+	if (nc_inq(ncid, &ndims, &nvars, nullptr, nullptr) != NC_NOERR)
+	{
+		return false;
+	}
+
+	itsDimSizes.assign(static_cast<size_t>(ndims), 0);
+
+	for (int i = 0; i < ndims; i++)
+	{
+		size_t len = 0;
+
+		if (nc_inq_dimlen(ncid, i, &len) != NC_NOERR)
+		{
+			return false;
+		}
+
+		itsDimSizes[static_cast<size_t>(i)] = static_cast<long>(len);
+	}
+
+	itsVariableDims.assign(static_cast<size_t>(nvars), {});
+
+	for (int i = 0; i < nvars; i++)
+	{
+		int num_dims = 0;
+		int dimids[NC_MAX_VAR_DIMS];
+
+		if (nc_inq_varndims(ncid, i, &num_dims) != NC_NOERR || nc_inq_vardimid(ncid, i, dimids) != NC_NOERR)
+		{
+			return false;
+		}
+
+		itsVariableDims[static_cast<size_t>(i)].assign(dimids, dimids + num_dims);
+	}
+
+	return true;
+}
+
+long NFmiNetCDF::DimSize(const NcDim* dim) const
+{
+	if (!dim)
+	{
+		return 0;
+	}
+
+	const auto id = static_cast<size_t>(dim->id());
+
+	return (id < itsDimSizes.size()) ? itsDimSizes[id] : 0;
+}
+
 bool NFmiNetCDF::ReadDimensions()
 {
 	/*
@@ -1095,46 +3222,13 @@ bool NFmiNetCDF::ReadDimensions()
 		fmt::print("z dim (optional): {}\n", (itsZDim ? "found" : "not found"));
 		fmt::print("m dim (optional): {}\n", (itsMDim ? "found" : "not found"));
 		return false;
-	}
-
-	return true;
-}
-
-bool NFmiNetCDF::ReadVariables()
-{
-	const auto ResolutionDrift = [](const vector<float>& tmp) -> float
-	{
-		// Check resolution
-
-		float resolution = 0;
-		float prevResolution = resolution;
-
-		float prevX = tmp[0];
-
-		for (unsigned int k = 1; k < tmp.size(); k++)
-		{
-			resolution = tmp[k] - prevX;
-
-			if (tmp[k] == -1 || prevX == -1)
-			{
-				prevX = tmp[k];
-				continue;
-			}
-			if (k == 1)
-				prevResolution = resolution;
-
-			if (abs(resolution - prevResolution) > MAX_COORDINATE_RESOLUTION_ERROR)
-			{
-				return abs(resolution - prevResolution);
-			}
-
-			prevResolution = resolution;
-			prevX = tmp[k];
-		}
+	}
 
-		return 0.0f;
-	};
+	return true;
+}
 
+bool NFmiNetCDF::ReadVariables()
+{
 	/*
 	 * Read variables from netcdf
 	 *
@@ -1142,13 +3236,21 @@ bool NFmiNetCDF::ReadVariables()
 	 * also each actual data parameter is presented as a variable.
 	 */
 
+	itsParameters.clear();
+	itsParameterIndex.clear();
+	itsVariableIndex.clear();
+	itsAttributes.assign(static_cast<size_t>(itsDataFile->num_vars()), {});
+
 	for (int i = 0; i < itsDataFile->num_vars(); i++)
 	{
 		NcVar* var = itsDataFile->get_var(i);
 
 		string varname = var->name();
 
-		if (itsZDim && (varname == static_cast<string>(itsZDim->name()) || NFmiNetCDF::Att(var, "axis") == "Z"))
+		itsVariableIndex[varname] = var;
+		CacheAttributes(var);
+
+		if (itsZDim && (varname == static_cast<string>(itsZDim->name()) || AttText(var, "axis") == "Z"))
 		{
 			/*
 			 * Assume level variable name equals to level dimension name. If it does not, how
@@ -1163,8 +3265,8 @@ bool NFmiNetCDF::ReadVariables()
 			continue;
 		}
 		else if (varname == static_cast<string>(itsXDim->name()) ||
-		         NFmiNetCDF::Att(var, "standard_name") == "longitude" ||
-		         NFmiNetCDF::Att(var, "standard_name") == "projection_x_coordinate")
+		         AttText(var, "standard_name") == "longitude" ||
+		         AttText(var, "standard_name") == "projection_x_coordinate")
 		{
 			// X-coordinate
 			// projected files might have multiple coordinate variables, for example
@@ -1176,60 +3278,28 @@ bool NFmiNetCDF::ReadVariables()
 			// Therefore if a variable has attribute axis set, do not override
 			// with other coordinate variables.
 
-			if (itsXVar && NFmiNetCDF::Att(itsXVar, "axis") == "X")
+			if (itsXVar && AttText(itsXVar, "axis") == "X")
 			{
 				continue;
 			}
 
 			itsXVar = var;
 
-			auto tmp = ::Values<float>(itsXVar);
-
-			if (itsXFlip)
-			{
-				reverse(tmp.begin(), tmp.end());
-			}
-
-			if (tmp.size() > 1)
-			{
-				if (xCoordinateWarning && ResolutionDrift(tmp) > 0.0f)
-				{
-					fmt::print("Warning: X dimension resolution is not constant: {}\n", ResolutionDrift(tmp));
-					xCoordinateWarning = false;
-				}
-			}
-
 			continue;
 		}
 		else if (varname == static_cast<string>(itsYDim->name()) ||
-		         NFmiNetCDF::Att(var, "standard_name") == "latitude" ||
-		         NFmiNetCDF::Att(var, "standard_name") == "projection_y_coordinate")
+		         AttText(var, "standard_name") == "latitude" ||
+		         AttText(var, "standard_name") == "projection_y_coordinate")
 		{
 			// Y-coordinate
 
-			if (itsYVar && NFmiNetCDF::Att(itsYVar, "axis") == "Y")
+			if (itsYVar && AttText(itsYVar, "axis") == "Y")
 			{
 				continue;
 			}
 
 			itsYVar = var;
 
-			auto tmp = ::Values<float>(itsYVar);
-
-			if (itsYFlip)
-			{
-				reverse(tmp.begin(), tmp.end());
-			}
-
-			if (tmp.size() > 1)
-			{
-				if (yCoordinateWarning && ResolutionDrift(tmp) > 0.0f)
-				{
-					fmt::print("Warning: Y dimension resolution is not constant: {}\n", ResolutionDrift(tmp));
-					yCoordinateWarning = false;
-				}
-			}
-
 			continue;
 		}
 		else if (varname == static_cast<string>(itsTDim->name()))
@@ -1260,24 +3330,21 @@ bool NFmiNetCDF::ReadVariables()
 
 		bool foundproj = false;
 
-		for (short k = 0; k < var->num_atts(); k++)
+		const Attribute* gridMapping = GetAtt(var, "grid_mapping_name");
+
+		if (gridMapping)
 		{
-			auto att = unique_ptr<NcAtt>(var->get_att(k));
-			if (static_cast<string>(att->name()) == "grid_mapping_name")
-			{
-				const auto ptr = unique_ptr<char[]>(att->as_string(0));
-				itsProjection = string(ptr.get());
+			itsProjection = gridMapping->text;
 
-				itsProjectionVar = var;
-				foundproj = true;
-				break;
-			}
+			itsProjectionVar = var;
+			foundproj = true;
 		}
 
 		if (foundproj || varname == "latitude" || varname == "longitude")
 			continue;
 
 		itsParameters.push_back(var);
+		itsParameterIndex[varname] = var;
 	}
 
 	assert(itsXVar && itsYVar && itsTVar);
@@ -1285,6 +3352,186 @@ bool NFmiNetCDF::ReadVariables()
 	return true;
 }
 
+/*
+ * LoadMetadata()
+ *
+ * Restore what ReadAttributes(), ReadDimensions() and ReadVariables() would
+ * find, plus time and level axes and resolution, from the sidecar of the file.
+ * Nothing is changed if sidecar does not exist or is not valid for the file.
+ */
+
+bool NFmiNetCDF::LoadMetadata()
+{
+	NFmiMetadata md;
+
+	if (!ReadMetadata(MetadataCacheFile(itsMetadataCache, itsFilePath), md))
+	{
+		return false;
+	}
+
+	if (md.path != itsFilePath || md.size != itsFileSize || md.mtime != itsFileMTime ||
+	    md.numDims != itsDataFile->num_dims() || md.numVars != itsDataFile->num_vars())
+	{
+		return false;
+	}
+
+	auto dim = [&](int id) { return (id >= 0 && id < md.numDims) ? itsDataFile->get_dim(id) : nullptr; };
+	auto var = [&](int id) { return (id >= 0 && id < md.numVars) ? itsDataFile->get_var(id) : nullptr; };
+
+	vector<NcVar*> parameters;
+
+	for (int id : md.parameters)
+	{
+		NcVar* param = var(id);
+
+		if (!param)
+		{
+			return false;
+		}
+
+		parameters.push_back(param);
+	}
+
+	if (!dim(md.xDim) || !dim(md.yDim) || !dim(md.tDim) || !var(md.xVar) || !var(md.yVar) || !var(md.tVar))
+	{
+		return false;
+	}
+
+	itsXDim = dim(md.xDim);
+	itsYDim = dim(md.yDim);
+	itsTDim = dim(md.tDim);
+	itsZDim = dim(md.zDim);
+	itsMDim = dim(md.mDim);
+
+	itsXVar = var(md.xVar);
+	itsYVar = var(md.yVar);
+	itsTVar = var(md.tVar);
+	itsZVar = var(md.zVar);
+	itsMVar = var(md.mVar);
+	itsProjectionVar = var(md.projectionVar);
+
+	itsConvention = md.convention;
+	itsProjection = md.projection;
+
+	itsVariableIndex.clear();
+
+	for (int i = 0; i < md.numVars; i++)
+	{
+		NcVar* v = itsDataFile->get_var(i);
+		itsVariableIndex[v->name()] = v;
+	}
+
+	itsParameters = parameters;
+	itsParameterIndex.clear();
+
+	for (NcVar* param : itsParameters)
+	{
+		itsParameterIndex[param->name()] = param;
+	}
+
+	itsAttributes = std::move(md.attributes);
+
+	itsTimes = std::move(md.times);
+	itsTimesSorted = std::is_sorted(itsTimes.begin(), itsTimes.end());
+
+	itsLevels = std::move(md.levels);
+	SortLevels();
+
+	itsValidated = md.validated;
+	itsXResolutionDrift = md.xResolutionDrift;
+	itsYResolutionDrift = md.yResolutionDrift;
+
+	if (itsValidated)
+	{
+		WarnResolutionDrift(itsXResolutionDrift, itsYResolutionDrift);
+	}
+
+	itsXResolution = md.xResolution;
+	itsYResolution = md.yResolution;
+	itsXResolutionCached = md.xResolutionCached;
+	itsYResolutionCached = md.yResolutionCached;
+
+	itsSavedMetadata = MetadataState();
+
+	return true;
+}
+
+void NFmiNetCDF::SaveMetadata()
+{
+	// Only what has been read so far is saved; this does not call the netcdf
+	// library, so it can be done when instance is destroyed
+
+	NFmiMetadata md;
+
+	md.path = itsFilePath;
+	md.size = itsFileSize;
+	md.mtime = itsFileMTime;
+
+	md.validated = itsValidated;
+	md.xResolutionDrift = itsXResolutionDrift;
+	md.yResolutionDrift = itsYResolutionDrift;
+	md.xResolutionCached = itsXResolutionCached;
+	md.yResolutionCached = itsYResolutionCached;
+	md.xResolution = itsXResolution;
+	md.yResolution = itsYResolution;
+
+	md.numDims = static_cast<int>(itsDimSizes.size());
+	md.numVars = static_cast<int>(itsVariableDims.size());
+
+	auto dimid = [](const NcDim* dim) { return dim ? dim->id() : -1; };
+	auto varid = [](const NcVar* var) { return var ? var->id() : -1; };
+
+	md.xDim = dimid(itsXDim);
+	md.yDim = dimid(itsYDim);
+	md.tDim = dimid(itsTDim);
+	md.zDim = dimid(itsZDim);
+	md.mDim = dimid(itsMDim);
+
+	md.xVar = varid(itsXVar);
+	md.yVar = varid(itsYVar);
+	md.tVar = varid(itsTVar);
+	md.zVar = varid(itsZVar);
+	md.mVar = varid(itsMVar);
+	md.projectionVar = varid(itsProjectionVar);
+
+	md.convention = itsConvention;
+	md.projection = itsProjection;
+
+	for (const NcVar* param : itsParameters)
+	{
+		md.parameters.push_back(param->id());
+	}
+
+	md.attributes = itsAttributes;
+	md.times = itsTimes;
+	md.levels = itsLevels;
+
+	if (!WriteMetadata(MetadataCacheFile(itsMetadataCache, md.path), md))
+	{
+		fmt::print("Unable to write metadata cache for {} to {}\n", itsFileName, itsMetadataCache);
+	}
+
+	// not tried again on failure
+	itsSavedMetadata = MetadataState();
+}
+
+// Rewrite the sidecar if axes or resolution have been read after it was
+// written
+
+void NFmiNetCDF::UpdateMetadata()
+{
+	if (itsSavedMetadata >= 0 && MetadataState() != itsSavedMetadata)
+	{
+		SaveMetadata();
+	}
+}
+
+int NFmiNetCDF::MetadataState() const
+{
+	return (itsTimes.empty() ? 0 : 1) | (itsLevels.empty() ? 0 : 2) | (itsValidated ? 4 : 0) |
+	       (itsXResolutionCached ? 8 : 0) | (itsYResolutionCached ? 16 : 0);
+}
+
 vector<pair<string, string>> ReadGlobalAttributes(NcFile* theFile)
 {
 	vector<pair<string, string>> ret;
@@ -1324,8 +3571,11 @@ bool NFmiNetCDF::ReadAttributes()
 }
 
 // free functions
-bool CopyAtts(NcVar* newvar, const NcVar* oldvar)
+bool CopyAtts(NcVar* newvar, const NcVar* oldvar, bool skipPacking)
 {
+	// skipPacking: leave out attributes that describe stored values, when
+	// newvar is packed differently from oldvar
+
 	assert(newvar);
 	assert(oldvar);
 
@@ -1335,6 +3585,17 @@ bool CopyAtts(NcVar* newvar, const NcVar* oldvar)
 
 		auto nctype = att->type();
 
+		if (skipPacking)
+		{
+			const string name = att->name();
+
+			if (name == "_FillValue" || name == "missing_value" || name == "scale_factor" || name == "add_offset" ||
+			    name == "valid_min" || name == "valid_max" || name == "valid_range")
+			{
+				continue;
+			}
+		}
+
 		if (static_cast<string>(att->name()) == "_FillValue" || static_cast<string>(att->name()) == "missing_value")
 		{
 			switch (oldvar->type())
@@ -1428,124 +3689,271 @@ bool CopyAtts(NcVar* newvar, const NcVar* oldvar)
 	return true;
 }
 
-bool CopyVar(NcVar** newvar, NcVar* oldvar, NcFile* theOutFile, long* dimension_position, long* dimension_length)
+NcDim* FindDim(NcFile* theFile, const char* name)
 {
-	// dimension_position: where to start copying from
-	// dimension_length: how large a chunk to copy
-	//
-	// if either are not set, default is to start from 0,0,0,..
-	// and copy everything
-	//
-	// this is what we want for example for geographic coordinates
-	//
-	// for time dimensions we only want to copy the current time step
+	for (int j = 0; j < theFile->num_dims(); j++)
+	{
+		NcDim* d = theFile->get_dim(j);
 
-	const int ndims = oldvar->num_dims();
+		if (strcmp(d->name(), name) == 0)
+		{
+			return d;
+		}
+	}
 
-	bool allocated = false;
+	return nullptr;
+}
 
-	if (!dimension_position)
-	{
-		allocated = true;
-		dimension_position = new long[ndims];
-		dimension_length = new long[ndims];
-	}
+NcVar* DefineVar(NcVar* oldvar, NcFile* theOutFile, NcType theType)
+{
+	// Define variable with the same name, type, dimensions and attributes
+	// as oldvar. Dimensions are matched by name and must already exist.
+	// If theType is given and differs from type of oldvar, values will be
+	// packed and packing attributes are not copied.
+
+	const NcType type = (theType == ncNoType) ? oldvar->type() : theType;
+
+	const int ndims = oldvar->num_dims();
 
 	vector<NcDim*> dims;
 	dims.reserve(ndims);
 
 	for (int i = 0; i < ndims; i++)
 	{
-		const auto name = oldvar->get_dim(i)->name();
-		for (int j = 0; j < theOutFile->num_dims(); j++)
-		{
-			NcDim* d = theOutFile->get_dim(j);
-
-			if (strcmp(d->name(), name) == 0)
-			{
-				dims.push_back(d);
+		NcDim* d = FindDim(theOutFile, oldvar->get_dim(i)->name());
 
-				if (allocated)
-				{
-					dimension_position[i] = 0;
-					dimension_length[i] = dims[i]->size();
-				}
-			}
+		if (!d)
+		{
+			// the file did not have correct dimensions (the same what oldvar has)
+			return nullptr;
 		}
-	}
 
-	if (dims.size() != static_cast<size_t>(ndims))
-	{
-		// the file did not have correct dimensions (the same what oldvar has)
-		return false;
+		dims.push_back(d);
 	}
 
 	const NcDim** dimptr = const_cast<const NcDim**>(dims.data());
 
-	switch (oldvar->type())
+	NcVar* newvar = nullptr;
+
+	switch (type)
 	{
 		case ncFloat:
-			(*newvar) = theOutFile->add_var(oldvar->name(), ncFloat, ndims, dimptr);
-			break;
 		case ncDouble:
-			(*newvar) = theOutFile->add_var(oldvar->name(), ncDouble, ndims, dimptr);
-			break;
 		case ncByte:
-			(*newvar) = theOutFile->add_var(oldvar->name(), ncByte, ndims, dimptr);
-			break;
 		case ncShort:
-			(*newvar) = theOutFile->add_var(oldvar->name(), ncShort, ndims, dimptr);
-			break;
 		case ncChar:
-			(*newvar) = theOutFile->add_var(oldvar->name(), ncChar, ndims, dimptr);
-			break;
 		case ncInt:
-			(*newvar) = theOutFile->add_var(oldvar->name(), ncInt, ndims, dimptr);
+			newvar = theOutFile->add_var(oldvar->name(), type, ndims, dimptr);
 			break;
 		default:
+			fmt::print("NcType {} is not supported for variable {}\n", fmt::underlying(oldvar->type()),
+			           oldvar->name());
 			break;
 	}
 
-	if (!(*newvar))
+	if (newvar)
 	{
-		return false;
+		CopyAtts(newvar, oldvar, type != oldvar->type());
+	}
+
+	return newvar;
+}
+
+template <typename T>
+bool CopyValues(NcVar* newvar, NcVar* oldvar, const long* dimension_position, const long* dimension_length,
+                const long* output_position, const CopyOptions& options)
+{
+	// Copy data in blocks of at most options.maxBytes. Block consists of full
+	// innermost dimensions and a slab of the outermost dimension that does not fit
+	// whole; outer dimensions before that are iterated one index at a time.
+	// If source is chunked, slab size is rounded down to whole chunks.
+	// T only defines the size of an element: values are read and written in
+	// the external type of the variable.
+
+	const int ndims = oldvar->num_dims();
+	const int varid = oldvar->id();
+	const int newvarid = newvar->id();
+
+	if (ndims == 0)
+	{
+		T value = T();
+		return nc_get_var(options.ncid, varid, &value) == NC_NOERR &&
+		       nc_put_var(options.outNcid, newvarid, &value) == NC_NOERR;
+	}
+
+	for (int i = 0; i < ndims; i++)
+	{
+		if (dimension_length[i] <= 0)
+		{
+			return true;
+		}
 	}
 
-	CopyAtts(*newvar, oldvar);
+	// split dimension d: dimensions after it fit fully in one block
+
+	const size_t maxElements = std::max(options.maxBytes / sizeof(T), size_t(1));
 
-	assert(*newvar);
-	if (!oldvar->set_cur(dimension_position))
+	size_t block = 1;
+	int d = ndims - 1;
+
+	while (d >= 0 && block * static_cast<size_t>(dimension_length[d]) <= maxElements)
 	{
-		return false;
+		block *= static_cast<size_t>(dimension_length[d]);
+		d--;
 	}
 
-	auto values = ::Values<float>(oldvar, dimension_length);
+	long step = (d < 0) ? 1 : static_cast<long>(std::max(maxElements / block, size_t(1)));
 
-	if (!(*newvar)->put(values.data(), dimension_length))
+	size_t chunks[NC_MAX_VAR_DIMS];
+	int storage = NC_CONTIGUOUS;
+
+	if (d >= 0 && nc_inq_var_chunking(options.ncid, varid, &storage, chunks) == NC_NOERR && storage == NC_CHUNKED)
 	{
-		return false;
+		const long chunk = static_cast<long>(chunks[d]);
+
+		if (chunk > 0 && chunk < step)
+		{
+			step -= step % chunk;
+		}
 	}
 
-	if (allocated)
+	if (d >= 0)
 	{
-		delete[] dimension_position;
-		delete[] dimension_length;
+		step = std::min(step, dimension_length[d]);
 	}
 
-	return true;
+	vector<T> values(block * static_cast<size_t>(step));
+
+	long offset[NC_MAX_VAR_DIMS] = {0};
+	size_t count[NC_MAX_VAR_DIMS], src[NC_MAX_VAR_DIMS], dst[NC_MAX_VAR_DIMS];
+
+	for (;;)
+	{
+		for (int i = 0; i < ndims; i++)
+		{
+			const long o = (i <= d) ? offset[i] : 0;
+
+			count[i] = static_cast<size_t>((i < d)    ? 1
+			                               : (i == d) ? std::min(step, dimension_length[d] - o)
+			                                          : dimension_length[i]);
+			src[i] = static_cast<size_t>(dimension_position[i] + o);
+			dst[i] = static_cast<size_t>((output_position ? output_position[i] : 0) + o);
+		}
+
+		int ret = nc_get_vara(options.ncid, varid, src, count, values.data());
+
+		if (ret == NC_NOERR)
+		{
+			ret = nc_put_vara(options.outNcid, newvarid, dst, count, values.data());
+		}
+
+		if (ret != NC_NOERR)
+		{
+			fmt::print("Copying variable {} failed: {}\n", oldvar->name(), nc_strerror(ret));
+			return false;
+		}
+
+		if (d < 0)
+		{
+			// everything fitted in one block
+			return true;
+		}
+
+		// advance to next block
+
+		int i = d;
+		offset[i] += step;
+
+		while (offset[i] >= dimension_length[i])
+		{
+			if (i == 0)
+			{
+				return true;
+			}
+
+			offset[i] = 0;
+			offset[--i]++;
+		}
+	}
+}
+
+bool CopyData(NcVar* newvar, NcVar* oldvar, long* dimension_position, long* dimension_length, long* output_position,
+              const CopyOptions& options)
+{
+	// dimension_position: where to start copying from
+	// dimension_length: how large a chunk to copy
+	// output_position: where to write in newvar
+	//
+	// if position and length are not set, default is to start from 0,0,0,..
+	// and copy everything
+	//
+	// this is what we want for example for geographic coordinates
+	//
+	// for time dimensions we only want to copy the current time step
+
+	const int ndims = oldvar->num_dims();
+
+	vector<long> position, length;
+
+	if (!dimension_position)
+	{
+		position.resize(ndims, 0);
+		length.resize(ndims);
+
+		for (int i = 0; i < ndims; i++)
+		{
+			length[i] = oldvar->get_dim(i)->size();
+		}
+
+		dimension_position = position.data();
+		dimension_length = length.data();
+	}
+
+	// Data is copied in the native type of the variable: no conversions,
+	// and packed data takes only as much memory as it does on disk
+
+	switch (oldvar->type())
+	{
+		case ncFloat:
+			return CopyValues<float>(newvar, oldvar, dimension_position, dimension_length, output_position, options);
+		case ncDouble:
+			return CopyValues<double>(newvar, oldvar, dimension_position, dimension_length, output_position, options);
+		case ncShort:
+			return CopyValues<short>(newvar, oldvar, dimension_position, dimension_length, output_position, options);
+		case ncInt:
+			return CopyValues<int>(newvar, oldvar, dimension_position, dimension_length, output_position, options);
+		case ncByte:
+			return CopyValues<ncbyte>(newvar, oldvar, dimension_position, dimension_length, output_position, options);
+		case ncChar:
+			return CopyValues<char>(newvar, oldvar, dimension_position, dimension_length, output_position, options);
+		default:
+			fmt::print("NcType {} not supported for variable {}\n", fmt::underlying(oldvar->type()), oldvar->name());
+			return false;
+	}
+}
+
+// Coordinate value at linear index, read as NcVar::as_double() or
+// NcVar::as_float() would depending on the variable type
+
+template <typename T>
+T CoordinateValue(int ncid, const NcVar* var, long index)
+{
+	const double val = ValueAt(ncid, var, index);
+
+	return ToSamePrecision<T>((var->type() == ncDouble) ? val : static_cast<float>(val));
 }
 
 template <typename T>
 T NFmiNetCDF::Lat0()
 {
+	lock_guard<recursive_mutex> lock(netcdfMutex);
+
 	T ret = kFloatMissing;
 	auto var = itsDataFile->get_var("latitude");
 
 	if (var)
 	{
-		auto type = var->type();
-		auto val = (type == ncDouble) ? var->as_double(0) : var->as_float(0);
-		ret = ToSamePrecision<T>(val);
+		ret = CoordinateValue<T>(itsDataFile->id(), var, 0);
 	}
 
 	return ret;
@@ -1557,13 +3965,13 @@ template double NFmiNetCDF::Lat0<double>();
 template <typename T>
 T NFmiNetCDF::Lon0()
 {
+	lock_guard<recursive_mutex> lock(netcdfMutex);
+
 	T ret = kFloatMissing;
 	auto var = itsDataFile->get_var("longitude");
 	if (var)
 	{
-		auto type = var->type();
-		auto val = (type == ncDouble) ? var->as_double(0) : var->as_float(0);
-		ret = ToSamePrecision<T>(val);
+		ret = CoordinateValue<T>(itsDataFile->id(), var, 0);
 	}
 	return ret;
 }
@@ -1574,23 +3982,21 @@ template double NFmiNetCDF::Lon0<double>();
 template <typename T>
 T NFmiNetCDF::X0()
 {
+	lock_guard<recursive_mutex> lock(netcdfMutex);
+
 	T ret = kFloatMissing;
 	if (Projection() == "polar_stereographic")
 	{
 		auto var = itsDataFile->get_var("longitude");
 		if (var)
 		{
-			auto type = var->type();
-			auto val = (type == ncDouble) ? var->as_double(0) : var->as_float(0);
-			ret = ToSamePrecision<T>(val);
+			ret = CoordinateValue<T>(itsDataFile->id(), var, 0);
 		}
 	}
 	else
 	{
 		assert(itsXVar);
-		auto type = itsXVar->type();
-		auto val = (type == ncDouble) ? itsXVar->as_double(0) : itsXVar->as_float(0);
-		ret = ToSamePrecision<T>(val);
+		ret = CoordinateValue<T>(itsDataFile->id(), itsXVar, 0);
 	}
 	return ret;
 }
@@ -1601,6 +4007,8 @@ template double NFmiNetCDF::X0<double>();
 template <typename T>
 T NFmiNetCDF::Y0()
 {
+	lock_guard<recursive_mutex> lock(netcdfMutex);
+
 	T ret = kFloatMissing;
 
 	if (Projection() == "polar_stereographic")
@@ -1608,17 +4016,13 @@ T NFmiNetCDF::Y0()
 		auto var = itsDataFile->get_var("latitude");
 		if (var)
 		{
-			auto type = var->type();
-			auto val = (type == ncDouble) ? var->as_double(0) : var->as_float(0);
-			ret = ToSamePrecision<T>(val);
+			ret = CoordinateValue<T>(itsDataFile->id(), var, 0);
 		}
 	}
 	else
 	{
 		assert(itsYVar);
-		auto type = itsYVar->type();
-		auto val = (type == ncDouble) ? itsYVar->as_double(0) : itsYVar->as_float(0);
-		ret = ToSamePrecision<T>(val);
+		ret = CoordinateValue<T>(itsDataFile->id(), itsYVar, 0);
 	}
 	return ret;
 }
@@ -1629,6 +4033,8 @@ template double NFmiNetCDF::Y0<double>();
 template <typename T>
 T NFmiNetCDF::X1()
 {
+	lock_guard<recursive_mutex> lock(netcdfMutex);
+
 	T ret = kFloatMissing;
 
 	if (Projection() == "polar_stereographic")
@@ -1636,18 +4042,13 @@ T NFmiNetCDF::X1()
 		auto var = itsDataFile->get_var("longitude");
 		if (var)
 		{
-			auto type = var->type();
-			auto val = (type == ncDouble) ? var->as_double(0) : var->as_float(0);
-			ret = ToSamePrecision<T>(val);
+			ret = CoordinateValue<T>(itsDataFile->id(), var, 0);
 		}
 	}
 	else
 	{
 		assert(itsXVar);
-		auto type = itsXVar->type();
-		size_t num = itsXVar->num_vals() - 1;
-		auto val = (type == ncDouble) ? itsXVar->as_double(num) : itsXVar->as_float(num);
-		ret = ToSamePrecision<T>(val);
+		ret = CoordinateValue<T>(itsDataFile->id(), itsXVar, itsXVar->num_vals() - 1);
 	}
 	return ret;
 }
@@ -1657,6 +4058,8 @@ template double NFmiNetCDF::X1<double>();
 template <typename T>
 T NFmiNetCDF::Y1()
 {
+	lock_guard<recursive_mutex> lock(netcdfMutex);
+
 	T ret = kFloatMissing;
 
 	if (Projection() == "polar_stereographic")
@@ -1664,18 +4067,13 @@ T NFmiNetCDF::Y1()
 		auto var = itsDataFile->get_var("latitude");
 		if (var)
 		{
-			auto type = var->type();
-			auto val = (type == ncDouble) ? var->as_double(0) : var->as_float(0);
-			ret = ToSamePrecision<T>(val);
+			ret = CoordinateValue<T>(itsDataFile->id(), var, 0);
 		}
 	}
 	else
 	{
 		assert(itsYVar);
-		auto type = itsYVar->type();
-		size_t num = itsYVar->num_vals() - 1;
-		auto val = (type == ncDouble) ? itsYVar->as_double(num) : itsYVar->as_float(num);
-		ret = ToSamePrecision<T>(val);
+		ret = CoordinateValue<T>(itsDataFile->id(), itsYVar, itsYVar->num_vals() - 1);
 	}
 	return ret;
 }
@@ -0,0 +1,328 @@
+#include "NFmiNetCDFPool.h"
+#include <cstdlib>
+#include <functional>
+#include <sys/stat.h>
+
+using namespace std;
+
+size_t EnvLimit(const char* name, size_t defaultValue)
+{
+	const char* value = getenv(name);
+
+	return value ? static_cast<size_t>(strtoull(value, nullptr, 10)) : defaultValue;
+}
+
+NFmiNetCDFPool::NFmiNetCDFPool(size_t theMaxFiles, size_t theMaxBytes)
+    : itsMaxFiles(theMaxFiles),
+      itsMaxBytes(theMaxBytes),
+      itsCount(0),
+      itsBytes(0),
+      itsClock(0),
+      itsHits(0),
+      itsMisses(0)
+{
+}
+
+NFmiNetCDFPool::~NFmiNetCDFPool()
+{
+	Clear();
+}
+
+NFmiNetCDFPool& NFmiNetCDFPool::Instance()
+{
+	static NFmiNetCDFPool pool(EnvLimit("FMINC_POOL_MAX_FILES", 256), EnvLimit("FMINC_POOL_MAX_BYTES", 0));
+
+	return pool;
+}
+
+NFmiNetCDFPool::Shard& NFmiNetCDFPool::ShardOf(const std::string& theFileName)
+{
+	return itsShards[hash<string>()(theFileName) % kShards];
+}
+
+bool NFmiNetCDFPool::Stat(const std::string& theFileName, Identity& theIdentity)
+{
+	struct stat st;
+
+	if (stat(theFileName.c_str(), &st) != 0)
+	{
+		return false;
+	}
+
+	theIdentity.size = static_cast<uint64_t>(st.st_size);
+	theIdentity.mtime = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+
+	return true;
+}
+
+shared_ptr<NFmiNetCDF> NFmiNetCDFPool::Get(const std::string& theFileName)
+{
+	Identity identity;
+
+	if (!Stat(theFileName, identity))
+	{
+		return nullptr;
+	}
+
+	unique_ptr<NFmiNetCDF> file;
+	vector<unique_ptr<NFmiNetCDF>> closed;
+
+	{
+		Shard& shard = ShardOf(theFileName);
+		lock_guard<mutex> lock(shard.mutex);
+
+		auto it = shard.index.find(theFileName);
+
+		if (it != shard.index.end())
+		{
+			Entry& entry = *it->second;
+
+			if (!(entry.identity == identity))
+			{
+				// file has changed since it was opened
+
+				Drop(entry, closed);
+				shard.lru.erase(it->second);
+				shard.index.erase(it);
+			}
+			else if (!entry.idle.empty())
+			{
+				file = std::move(entry.idle.back());
+				entry.idle.pop_back();
+
+				itsBytes -= entry.bytes.back();
+				entry.bytes.pop_back();
+				itsCount--;
+
+				entry.lastUse = itsClock++;
+				shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+			}
+		}
+	}
+
+	// instances close their files holding the library mutex, see
+	// NFmiNetCDF::LibraryMutex()
+
+	closed.clear();
+
+	if (file)
+	{
+		itsHits++;
+	}
+	else
+	{
+		itsMisses++;
+
+		file.reset(new NFmiNetCDF());
+
+		if (!file->Read(theFileName))
+		{
+			file.reset();
+			return nullptr;
+		}
+	}
+
+	NFmiNetCDF* ptr = file.release();
+
+	return shared_ptr<NFmiNetCDF>(ptr, [this, theFileName, identity](NFmiNetCDF* p)
+	                              { Release(theFileName, identity, unique_ptr<NFmiNetCDF>(p)); });
+}
+
+void NFmiNetCDFPool::Release(const std::string& theFileName, const Identity& theIdentity,
+                             unique_ptr<NFmiNetCDF> theFile)
+{
+	if (itsMaxFiles == 0)
+	{
+		return;
+	}
+
+	const size_t bytes = theFile->MemoryUsage();
+	vector<unique_ptr<NFmiNetCDF>> closed;
+
+	{
+		Shard& shard = ShardOf(theFileName);
+		lock_guard<mutex> lock(shard.mutex);
+
+		auto it = shard.index.find(theFileName);
+
+		if (it == shard.index.end())
+		{
+			shard.lru.push_front(Entry{theFileName, theIdentity, {}, {}, 0});
+			it = shard.index.emplace(theFileName, shard.lru.begin()).first;
+		}
+		else if (!(it->second->identity == theIdentity))
+		{
+			// Pooled instances are of another version of the file. Keep the
+			// version the file has now, or the newer one if it can not be
+			// checked; the file is rarely changed, so stat under the lock.
+
+			Entry& entry = *it->second;
+			Identity current;
+
+			const bool known = Stat(theFileName, current);
+			const bool pooledCurrent = known ? (current == entry.identity) : (entry.identity.mtime > theIdentity.mtime);
+			const bool returnedCurrent = known ? (current == theIdentity) : !pooledCurrent;
+
+			if (!pooledCurrent)
+			{
+				Drop(entry, closed);
+				entry.identity = theIdentity;
+			}
+
+			if (!returnedCurrent)
+			{
+				closed.push_back(std::move(theFile));
+			}
+		}
+
+		if (theFile)
+		{
+			Entry& entry = *it->second;
+
+			entry.idle.push_back(std::move(theFile));
+			entry.bytes.push_back(bytes);
+			entry.lastUse = itsClock++;
+
+			itsCount++;
+			itsBytes += bytes;
+
+			shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+		}
+	}
+
+	// instances are closed without holding the shard lock
+
+	closed.clear();
+	Evict();
+}
+
+void NFmiNetCDFPool::Drop(Entry& theEntry, vector<unique_ptr<NFmiNetCDF>>& closed)
+{
+	for (size_t i = 0; i < theEntry.idle.size(); i++)
+	{
+		closed.push_back(std::move(theEntry.idle[i]));
+		itsBytes -= theEntry.bytes[i];
+	}
+
+	itsCount -= theEntry.idle.size();
+
+	theEntry.idle.clear();
+	theEntry.bytes.clear();
+}
+
+bool NFmiNetCDFPool::OverLimits() const
+{
+	const size_t maxBytes = itsMaxBytes;
+
+	return itsCount > itsMaxFiles || (maxBytes > 0 && itsBytes > maxBytes);
+}
+
+void NFmiNetCDFPool::Evict()
+{
+	while (OverLimits())
+	{
+		// Each shard is in LRU order, so the least recently used instance of
+		// the pool is at the tail of one of them. Shards are locked one at a
+		// time; eviction is rare, so the scan is cheap enough.
+
+		Shard* oldest = nullptr;
+		uint64_t oldestUse = 0;
+
+		for (Shard& shard : itsShards)
+		{
+			lock_guard<mutex> lock(shard.mutex);
+
+			if (!shard.lru.empty() && (!oldest || shard.lru.back().lastUse < oldestUse))
+			{
+				oldest = &shard;
+				oldestUse = shard.lru.back().lastUse;
+			}
+		}
+
+		if (!oldest)
+		{
+			return;
+		}
+
+		vector<unique_ptr<NFmiNetCDF>> closed;
+
+		{
+			lock_guard<mutex> lock(oldest->mutex);
+
+			if (!oldest->lru.empty())
+			{
+				Entry& entry = oldest->lru.back();
+
+				if (!entry.idle.empty())
+				{
+					closed.push_back(std::move(entry.idle.back()));
+					entry.idle.pop_back();
+
+					itsBytes -= entry.bytes.back();
+					entry.bytes.pop_back();
+					itsCount--;
+				}
+
+				// entries without idle instances only remember the identity
+
+				if (entry.idle.empty())
+				{
+					oldest->index.erase(entry.fileName);
+					oldest->lru.pop_back();
+				}
+			}
+		}
+
+		closed.clear();
+	}
+}
+
+void NFmiNetCDFPool::Limits(size_t theMaxFiles, size_t theMaxBytes)
+{
+	itsMaxFiles = theMaxFiles;
+	itsMaxBytes = theMaxBytes;
+
+	Evict();
+}
+
+void NFmiNetCDFPool::Clear()
+{
+	for (Shard& shard : itsShards)
+	{
+		vector<unique_ptr<NFmiNetCDF>> closed;
+
+		{
+			lock_guard<mutex> lock(shard.mutex);
+
+			for (Entry& entry : shard.lru)
+			{
+				Drop(entry, closed);
+			}
+
+			shard.lru.clear();
+			shard.index.clear();
+		}
+
+		closed.clear();
+	}
+}
+
+size_t NFmiNetCDFPool::Size() const
+{
+	return itsCount;
+}
+
+size_t NFmiNetCDFPool::Bytes() const
+{
+	return itsBytes;
+}
+
+size_t NFmiNetCDFPool::Hits() const
+{
+	return itsHits;
+}
+
+size_t NFmiNetCDFPool::Misses() const
+{
+	return itsMisses;
+}
@@ -0,0 +1,193 @@
+#include "NFmiPrecision.h"
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <fmt/format.h>
+#include <type_traits>
+
+using namespace std;
+
+const bool USE_IMPROVED_PRECISION =
+    getenv("FMINC_USE_IMPROVED_PRECISION") != nullptr && getenv("FMINC_USE_IMPROVED_PRECISION")[0] == '1';
+
+typedef unsigned __int128 uint128;
+
+// Powers of ten exact as double; up to 1e10 they are exact as float too
+
+const double POW10[] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+                        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+/*
+ * ScaledDecimal()
+ *
+ * |val| * 10^num_digits rounded to an integer, ties to even. The product is
+ * computed exactly, so the result has the digits printf and fmt print for val
+ * with num_digits decimals. Returns false if num_digits is not in 0..27 or the
+ * result does not fit.
+ */
+
+bool ScaledDecimal(double val, int num_digits, uint128& result)
+{
+	if (!std::isfinite(val) || num_digits < 0 || num_digits > 27)
+	{
+		return false;
+	}
+
+	val = std::fabs(val);
+
+	if (val == 0)
+	{
+		result = 0;
+		return true;
+	}
+
+	// val = mantissa * 2^exponent, mantissa < 2^53
+
+	int exponent;
+	const auto mantissa = static_cast<uint64_t>(std::ldexp(std::frexp(val, &exponent), 53));
+	exponent -= 53;
+
+	// val * 10^n = mantissa * 5^n * 2^(exponent + n); 5^27 < 2^63, so the
+	// product is below 2^116
+
+	uint128 scaled = mantissa;
+
+	for (int i = 0; i < num_digits; i++)
+	{
+		scaled *= 5;
+	}
+
+	const int shift = exponent + num_digits;
+
+	if (shift >= 0)
+	{
+		if (shift > 11)
+		{
+			return false;
+		}
+
+		result = scaled << shift;
+		return true;
+	}
+
+	if (-shift > 116)
+	{
+		// less than half
+		result = 0;
+		return true;
+	}
+
+	const uint128 one = 1;
+	const uint128 quotient = scaled >> -shift;
+	const uint128 remainder = scaled & ((one << -shift) - 1);
+	const uint128 half = one << (-shift - 1);
+
+	result = quotient + ((remainder > half || (remainder == half && (quotient & 1))) ? 1 : 0);
+
+	return true;
+}
+
+int NumberOfDecimalDigits(double val)
+{
+	if (!std::isfinite(val) || val == std::trunc(val))
+	{
+		return 0;
+	}
+
+	uint128 scaled;
+
+	if (!ScaledDecimal(val, 6, scaled))
+	{
+		return 0;
+	}
+
+	auto decimals = static_cast<uint64_t>(scaled % 1000000);
+
+	if (decimals == 0)
+	{
+		return 0;
+	}
+
+	int num_digits = 6;
+
+	while (decimals % 10 == 0)
+	{
+		decimals /= 10;
+		num_digits--;
+	}
+
+	return num_digits;
+}
+
+template <typename T, typename U>
+T ToPrecision(U val, int num_digits)
+{
+	if (USE_IMPROVED_PRECISION == false)
+	{
+		return static_cast<T>(val);
+	}
+
+	// Rounding does not change integral values
+
+	if (val == std::trunc(val))
+	{
+		return static_cast<T>(val);
+	}
+
+	// Parsing the printed value gives the decimal digits divided by a power of
+	// ten, correctly rounded to T. When both are exact in T, one division
+	// rounds the same way.
+
+	const bool isFloat = std::is_same<T, float>::value;
+	const int maxDigits = isFloat ? 10 : 22;
+	const uint128 maxScaled = uint128(1) << (isFloat ? 24 : 53);
+
+	uint128 scaled;
+
+	if (num_digits <= maxDigits && ScaledDecimal(static_cast<double>(val), num_digits, scaled) && scaled <= maxScaled)
+	{
+		const T ret = static_cast<T>(static_cast<uint64_t>(scaled)) / static_cast<T>(POW10[num_digits]);
+		return std::signbit(val) ? -ret : ret;
+	}
+
+	// Otherwise print and parse, in a stack buffer
+
+	char buf[512];
+	const auto res = fmt::format_to_n(buf, sizeof(buf) - 1, "{:.{}f}", val, num_digits);
+	*res.out = '\0';
+
+	if constexpr (std::is_same<T, float>::value)
+	{
+		return std::strtof(buf, nullptr);
+	}
+	else
+	{
+		return std::strtod(buf, nullptr);
+	}
+}
+
+template <typename T, typename U>
+T ToSamePrecision(U val)
+{
+	// If casting from float to double, we might get
+	// some unwanted extra decimal digits.
+	// Make sure that after casting we have the same
+	// number of digits.
+
+	if (USE_IMPROVED_PRECISION == false)
+	{
+		return static_cast<T>(val);
+	}
+
+	return ToPrecision<T>(val, NumberOfDecimalDigits(val));
+}
+
+template float ToPrecision<float, float>(float, int);
+template float ToPrecision<float, double>(double, int);
+template double ToPrecision<double, float>(float, int);
+template double ToPrecision<double, double>(double, int);
+
+template float ToSamePrecision<float, float>(float);
+template float ToSamePrecision<float, double>(double);
+template double ToSamePrecision<double, float>(float);
+template double ToSamePrecision<double, double>(double);
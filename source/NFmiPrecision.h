@@ -0,0 +1,33 @@
+/*
+ * Decimal rounding of coordinate and resolution values
+ *
+ * With FMINC_USE_IMPROVED_PRECISION=1 values are rounded to the number of
+ * decimals they were written with, to remove binary noise from float to double
+ * conversions. The result is the same as printing the value with that many
+ * decimals and parsing it back, but it is computed without text in all but
+ * rare cases. bench/fminc_precision checks this against the text round-trip.
+ *
+ * Internal to fminc.
+ */
+
+#ifndef NFMIPRECISION_H
+#define NFMIPRECISION_H
+
+// Number of decimals in std::to_string(val) with trailing zeros removed, ie.
+// when printed with six decimals
+
+int NumberOfDecimalDigits(double val);
+
+// val rounded to num_digits decimals and converted to T, as if printed with
+// fmt "{:.<num_digits>f}" and parsed with strtof/strtod. Without improved
+// precision values are only converted.
+
+template <typename T, typename U>
+T ToPrecision(U val, int num_digits);
+
+// val rounded to the decimals it has when printed with std::to_string()
+
+template <typename T, typename U>
+T ToSamePrecision(U val);
+
+#endif /* NFMIPRECISION_H */
@@ -0,0 +1,165 @@
+#include "NFmiPrefetcher.h"
+#include <algorithm>
+
+using namespace std;
+
+template <typename T>
+NFmiPrefetcher<T>::NFmiPrefetcher(const NFmiNetCDF& theFile, const vector<NFmiNetCDF::SliceRequest>& theRequests,
+                                  size_t theDepth)
+    : itsFile(theFile.Reopen()),
+      itsRequests(theRequests),
+      itsDepth(std::max(size_t(1), theDepth)),
+      itsReturned(0),
+      itsStop(false)
+{
+	if (!itsFile)
+	{
+		return;
+	}
+
+	itsThread = thread(&NFmiPrefetcher<T>::Run, this);
+}
+
+template <typename T>
+NFmiPrefetcher<T>::~NFmiPrefetcher()
+{
+	{
+		lock_guard<mutex> lock(itsMutex);
+		itsStop = true;
+	}
+
+	itsCondition.notify_all();
+
+	if (itsThread.joinable())
+	{
+		itsThread.join();
+	}
+}
+
+template <typename T>
+void NFmiPrefetcher<T>::Run()
+{
+	for (const auto& req : itsRequests)
+	{
+		vector<T> buffer;
+
+		{
+			unique_lock<mutex> lock(itsMutex);
+			itsCondition.wait(lock, [&]() { return itsStop || itsReady.size() < itsDepth; });
+
+			if (itsStop)
+			{
+				return;
+			}
+
+			if (!itsFree.empty())
+			{
+				buffer = std::move(itsFree.back());
+				itsFree.pop_back();
+			}
+		}
+
+		itsFile->Values<T>(req, buffer);
+
+		{
+			lock_guard<mutex> lock(itsMutex);
+			itsReady.push_back(std::move(buffer));
+		}
+
+		itsCondition.notify_all();
+	}
+}
+
+template <typename T>
+bool NFmiPrefetcher<T>::Next()
+{
+	if (!itsFile || itsReturned >= itsRequests.size())
+	{
+		return false;
+	}
+
+	{
+		unique_lock<mutex> lock(itsMutex);
+
+		if (itsReturned > 0)
+		{
+			itsFree.push_back(std::move(itsCurrent));
+		}
+
+		itsCondition.wait(lock, [&]() { return !itsReady.empty(); });
+
+		itsCurrent = std::move(itsReady.front());
+		itsReady.pop_front();
+	}
+
+	// room for one more slice ahead
+	itsCondition.notify_all();
+
+	itsReturned++;
+
+	return true;
+}
+
+template <typename T>
+const NFmiNetCDF::SliceRequest& NFmiPrefetcher<T>::Request() const
+{
+	assert(itsReturned > 0);
+	return itsRequests[itsReturned - 1];
+}
+
+template <typename T>
+const vector<T>& NFmiPrefetcher<T>::Values() const
+{
+	return itsCurrent;
+}
+
+template <typename T>
+vector<NFmiNetCDF::SliceRequest> NFmiPrefetcher<T>::AllSlices(const NFmiNetCDF& theFile,
+                                                             const vector<string>& theParameters)
+{
+	// levels of each parameter, -1 if parameter has no z dimension
+
+	vector<pair<string, vector<long>>> params;
+
+	for (const auto& name : theParameters)
+	{
+		if (!theFile.HasParameter(name))
+		{
+			continue;
+		}
+
+		vector<long> levels;
+
+		if (theFile.HasLevels(name))
+		{
+			for (long z = 0; z < theFile.SizeZ(); z++)
+			{
+				levels.push_back(z);
+			}
+		}
+		else
+		{
+			levels.push_back(-1);
+		}
+
+		params.emplace_back(name, levels);
+	}
+
+	vector<NFmiNetCDF::SliceRequest> requests;
+
+	for (long t = 0; t < theFile.SizeT(); t++)
+	{
+		for (const auto& p : params)
+		{
+			for (long z : p.second)
+			{
+				requests.push_back(NFmiNetCDF::SliceRequest{p.first, t, z});
+			}
+		}
+	}
+
+	return requests;
+}
+
+template class NFmiPrefetcher<float>;
+template class NFmiPrefetcher<double>;
@@ -0,0 +1,148 @@
+#include "NFmiSliceCache.h"
+#include <cstdlib>
+
+using namespace std;
+
+const size_t DEFAULT_SLICE_CACHE_BYTES = 256 * 1024 * 1024;
+
+NFmiSliceCache::NFmiSliceCache(size_t theMaxBytes) : itsBytes(0), itsMaxBytes(theMaxBytes), itsHits(0), itsMisses(0)
+{
+}
+
+NFmiSliceCache& NFmiSliceCache::Instance()
+{
+	static NFmiSliceCache cache(getenv("FMINC_SLICE_CACHE_BYTES")
+	                                ? static_cast<size_t>(strtoull(getenv("FMINC_SLICE_CACHE_BYTES"), nullptr, 10))
+	                                : DEFAULT_SLICE_CACHE_BYTES);
+
+	return cache;
+}
+
+template <typename T>
+shared_ptr<const vector<T>> NFmiSliceCache::Find(const std::string& theKey)
+{
+	return static_pointer_cast<const vector<T>>(FindEntry(theKey));
+}
+
+template shared_ptr<const vector<float>> NFmiSliceCache::Find(const std::string&);
+template shared_ptr<const vector<double>> NFmiSliceCache::Find(const std::string&);
+
+template <typename T>
+void NFmiSliceCache::Insert(const std::string& theKey, const shared_ptr<const vector<T>>& theValues)
+{
+	if (theValues)
+	{
+		InsertEntry(theKey, theValues, sizeof(vector<T>) + theValues->capacity() * sizeof(T));
+	}
+}
+
+template void NFmiSliceCache::Insert(const std::string&, const shared_ptr<const vector<float>>&);
+template void NFmiSliceCache::Insert(const std::string&, const shared_ptr<const vector<double>>&);
+
+shared_ptr<const void> NFmiSliceCache::FindEntry(const std::string& theKey)
+{
+	lock_guard<mutex> lock(itsMutex);
+
+	const auto it = itsIndex.find(theKey);
+
+	if (it == itsIndex.end())
+	{
+		itsMisses++;
+		return nullptr;
+	}
+
+	itsHits++;
+	itsLru.splice(itsLru.begin(), itsLru, it->second);
+
+	return it->second->values;
+}
+
+void NFmiSliceCache::InsertEntry(const std::string& theKey, shared_ptr<const void> theValues, size_t theBytes)
+{
+	// buffers are released outside the lock; it might be the last reference
+	vector<shared_ptr<const void>> evicted;
+
+	{
+		lock_guard<mutex> lock(itsMutex);
+
+		if (theBytes > itsMaxBytes)
+		{
+			return;
+		}
+
+		const auto it = itsIndex.find(theKey);
+
+		if (it != itsIndex.end())
+		{
+			// another reader inserted the same slice meanwhile
+			itsLru.splice(itsLru.begin(), itsLru, it->second);
+			return;
+		}
+
+		itsLru.push_front(Entry{theKey, std::move(theValues), theBytes});
+		itsIndex.emplace(theKey, itsLru.begin());
+		itsBytes += theBytes;
+
+		Evict(evicted);
+	}
+}
+
+void NFmiSliceCache::Evict(vector<shared_ptr<const void>>& evicted)
+{
+	while (itsBytes > itsMaxBytes && !itsLru.empty())
+	{
+		Entry& entry = itsLru.back();
+
+		itsBytes -= entry.bytes;
+		evicted.push_back(std::move(entry.values));
+		itsIndex.erase(entry.key);
+		itsLru.pop_back();
+	}
+}
+
+size_t NFmiSliceCache::MaxBytes() const
+{
+	lock_guard<mutex> lock(itsMutex);
+	return itsMaxBytes;
+}
+
+void NFmiSliceCache::MaxBytes(size_t theMaxBytes)
+{
+	vector<shared_ptr<const void>> evicted;
+
+	lock_guard<mutex> lock(itsMutex);
+	itsMaxBytes = theMaxBytes;
+	Evict(evicted);
+}
+
+void NFmiSliceCache::Clear()
+{
+	list<Entry> entries;
+
+	lock_guard<mutex> lock(itsMutex);
+	entries.swap(itsLru);
+	itsIndex.clear();
+	itsBytes = 0;
+}
+
+size_t NFmiSliceCache::Size() const
+{
+	lock_guard<mutex> lock(itsMutex);
+	return itsIndex.size();
+}
+
+size_t NFmiSliceCache::Bytes() const
+{
+	lock_guard<mutex> lock(itsMutex);
+	return itsBytes;
+}
+
+size_t NFmiSliceCache::Hits() const
+{
+	return itsHits;
+}
+
+size_t NFmiSliceCache::Misses() const
+{
+	return itsMisses;
+}